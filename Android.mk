@@ -14,13 +14,24 @@ LOCAL_CPP_STD := c++17
 LOCAL_SRC_FILES := \
     service.cpp \
     DrmComposer.cpp \
+    LayerTable.cpp \
     DrmDevice.cpp \
     DrmDisplay.cpp \
+    DrmVsyncModel.cpp \
     DrmFramebuffer.cpp \
+    DrmFramebufferCache.cpp \
     DrmFramebufferLibDrm.cpp \
+    DrmGemHandleTable.cpp \
     GraphicsThread.cpp \
-    DrmVsyncThread.cpp \
-    DrmHotplugThread.cpp
+    DrmCommitThread.cpp \
+    DrmCursor.cpp \
+    SoftwareCompositor.cpp \
+    VirtualDisplayThread.cpp \
+    BlendKernels.cpp \
+    SyncTimeline.cpp \
+    DrmEventThread.cpp \
+    DrmHotplugThread.cpp \
+    ThreadScheduling.cpp
 
 LOCAL_HEADER_LIBRARIES := \
     android.hardware.graphics.composer@2.1-hal
@@ -50,3 +61,13 @@ ifeq ($(strip $(BOARD_USES_MINIGBM)), true)
 endif
 
 include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+LOCAL_MODULE := drmfb-blend-benchmark
+LOCAL_MODULE_TAGS := optional
+LOCAL_VENDOR_MODULE := true
+LOCAL_CPP_STD := c++17
+LOCAL_SRC_FILES := \
+    BlendKernels.cpp \
+    BlendBenchmark.cpp
+include $(BUILD_EXECUTABLE)
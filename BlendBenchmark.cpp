@@ -0,0 +1,102 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (C) 2019 Stephan Gerhold
+
+/*
+ * Compares the throughput of the blend and channel swap kernels for software
+ * composition with the scalar implementation, and verifies that they produce the same
+ * result. Does not depend on Android, so it can also be built on the host:
+ *   c++ -std=c++17 -O2 BlendKernels.cpp BlendBenchmark.cpp
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+#include "BlendKernels.h"
+
+using namespace android::hardware::graphics::composer::V2_1::drmfb;
+
+namespace {
+constexpr size_t WIDTH = 1920;
+constexpr size_t HEIGHT = 1080;
+constexpr int ITERATIONS = 50;
+
+std::vector<uint32_t> randomPixels(size_t count, bool premultiplied) {
+    std::mt19937 rng{count};
+    std::vector<uint32_t> pixels(count);
+    for (auto& p : pixels) {
+        uint32_t a = rng() & 0xff;
+        uint32_t max = premultiplied ? a : 0xff;
+        p = a << 24;
+        for (int c = 0; c < 3; ++c)
+            p |= (rng() % (max + 1)) << (c * 8);
+    }
+    return pixels;
+}
+
+double run(const BlendKernels& kernels, const std::vector<uint32_t>& src,
+        std::vector<uint32_t>& dst, uint8_t alpha) {
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < ITERATIONS; ++i) {
+        for (size_t y = 0; y < HEIGHT; ++y)
+            kernels.blend(&dst[y * WIDTH], &src[y * WIDTH], WIDTH, alpha);
+    }
+    std::chrono::duration<double> time = std::chrono::steady_clock::now() - start;
+    return WIDTH * HEIGHT * ITERATIONS / time.count() / 1e6;
+}
+}
+
+int main() {
+    auto src = randomPixels(WIDTH * HEIGHT, true);
+    auto background = randomPixels(WIDTH * HEIGHT, false);
+    auto ok = true;
+
+    for (uint8_t alpha : {255, 128}) {
+        printf("Plane alpha %u:\n", alpha);
+
+        double reference = 0;
+        std::vector<uint32_t> expected;
+        for (auto kernels : availableBlendKernels()) {
+            // Verify the result of a single pass first
+            auto dst = background;
+            for (size_t y = 0; y < HEIGHT; ++y)
+                kernels->blend(&dst[y * WIDTH], &src[y * WIDTH], WIDTH, alpha);
+            if (expected.empty()) {
+                expected = dst;
+            } else if (dst != expected) {
+                printf("  %-8s result differs from scalar implementation\n", kernels->name);
+                ok = false;
+            }
+
+            dst = background;
+            auto mpix = run(*kernels, src, dst, alpha);
+            if (!reference)
+                reference = mpix;
+            printf("  %-8s %8.1f MPix/s (%.2fx)\n", kernels->name, mpix, mpix / reference);
+        }
+    }
+
+    printf("Channel swap:\n");
+    std::vector<uint32_t> expected(WIDTH * HEIGHT);
+    double reference = 0;
+    for (auto kernels : availableBlendKernels()) {
+        std::vector<uint32_t> dst(WIDTH * HEIGHT);
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < ITERATIONS; ++i)
+            kernels->swap(dst.data(), background.data(), dst.size());
+        std::chrono::duration<double> time = std::chrono::steady_clock::now() - start;
+        auto mpix = WIDTH * HEIGHT * ITERATIONS / time.count() / 1e6;
+
+        if (!reference) {
+            reference = mpix;
+            expected = dst;
+        } else if (dst != expected) {
+            printf("  %-8s result differs from scalar implementation\n", kernels->name);
+            ok = false;
+        }
+        printf("  %-8s %8.1f MPix/s (%.2fx)\n", kernels->name, mpix, mpix / reference);
+    }
+
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,248 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (C) 2019 Stephan Gerhold
+
+#define LOG_TAG "drmfb-blend"
+
+#include <algorithm>
+#include <cstring>
+#include "BlendKernels.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BLEND_X86
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define BLEND_NEON
+#endif
+
+namespace android {
+namespace hardware {
+namespace graphics {
+namespace composer {
+namespace V2_1 {
+namespace drmfb {
+
+namespace {
+
+/* Scalar */
+
+// Multiply all four channels with a (0-255) and divide by 255 (rounded)
+inline uint32_t scale(uint32_t p, uint32_t a) {
+    uint32_t rb = (p & 0x00ff00ff) * a + 0x00800080;
+    rb = ((rb + ((rb >> 8) & 0x00ff00ff)) >> 8) & 0x00ff00ff;
+    uint32_t ag = ((p >> 8) & 0x00ff00ff) * a + 0x00800080;
+    ag = (ag + ((ag >> 8) & 0x00ff00ff)) & 0xff00ff00;
+    return rb | ag;
+}
+
+inline uint32_t blendPixel(uint32_t d, uint32_t s, uint32_t alpha) {
+    if (alpha != 255)
+        s = scale(s, alpha);
+    return s + scale(d, 255 - (s >> 24));
+}
+
+void copyScalar(uint32_t* dst, const uint32_t* src, size_t count) {
+    memcpy(dst, src, count * sizeof(uint32_t));
+}
+
+void fillScalar(uint32_t* dst, uint32_t color, size_t count) {
+    std::fill_n(dst, count, color);
+}
+
+void blendScalar(uint32_t* dst, const uint32_t* src, size_t count, uint8_t alpha) {
+    for (size_t i = 0; i < count; ++i)
+        dst[i] = blendPixel(dst[i], src[i], alpha);
+}
+
+void swapScalar(uint32_t* dst, const uint32_t* src, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        auto p = src[i];
+        dst[i] = (p & 0xff00ff00) | ((p >> 16) & 0xff) | ((p & 0xff) << 16);
+    }
+}
+
+constexpr BlendKernels SCALAR{"scalar", copyScalar, fillScalar, blendScalar, swapScalar};
+
+#ifdef BLEND_X86
+
+/* SSE4.1 (4 pixels) */
+
+__attribute__((target("sse4.1")))
+inline __m128i div255(__m128i x) {
+    x = _mm_add_epi16(x, _mm_set1_epi16(128));
+    return _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+}
+
+// Multiply each byte with the corresponding byte of a and divide by 255
+__attribute__((target("sse4.1")))
+inline __m128i scale(__m128i p, __m128i a) {
+    auto zero = _mm_setzero_si128();
+    auto lo = _mm_mullo_epi16(_mm_unpacklo_epi8(p, zero), _mm_unpacklo_epi8(a, zero));
+    auto hi = _mm_mullo_epi16(_mm_unpackhi_epi8(p, zero), _mm_unpackhi_epi8(a, zero));
+    return _mm_packus_epi16(div255(lo), div255(hi));
+}
+
+__attribute__((target("sse4.1")))
+void blendSse4(uint32_t* dst, const uint32_t* src, size_t count, uint8_t alpha) {
+    const auto broadcastAlpha = _mm_setr_epi8(3, 3, 3, 3, 7, 7, 7, 7,
+                                              11, 11, 11, 11, 15, 15, 15, 15);
+    const auto planeAlpha = _mm_set1_epi8(static_cast<char>(alpha));
+    const auto ones = _mm_set1_epi8(-1);
+
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        auto s = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+        auto d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(dst + i));
+        if (alpha != 255)
+            s = scale(s, planeAlpha);
+
+        auto inverse = _mm_xor_si128(_mm_shuffle_epi8(s, broadcastAlpha), ones);
+        d = _mm_adds_epu8(s, scale(d, inverse));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), d);
+    }
+    blendScalar(dst + i, src + i, count - i, alpha);
+}
+
+__attribute__((target("sse4.1")))
+void swapSse4(uint32_t* dst, const uint32_t* src, size_t count) {
+    const auto order = _mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        auto s = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_shuffle_epi8(s, order));
+    }
+    swapScalar(dst + i, src + i, count - i);
+}
+
+constexpr BlendKernels SSE4{"sse4.1", copyScalar, fillScalar, blendSse4, swapSse4};
+
+/* AVX2 (8 pixels) */
+
+__attribute__((target("avx2")))
+inline __m256i div255(__m256i x) {
+    x = _mm256_add_epi16(x, _mm256_set1_epi16(128));
+    return _mm256_srli_epi16(_mm256_add_epi16(x, _mm256_srli_epi16(x, 8)), 8);
+}
+
+// Unpack and pack operate on each 128-bit lane, so the pixel order is kept
+__attribute__((target("avx2")))
+inline __m256i scale(__m256i p, __m256i a) {
+    auto zero = _mm256_setzero_si256();
+    auto lo = _mm256_mullo_epi16(_mm256_unpacklo_epi8(p, zero), _mm256_unpacklo_epi8(a, zero));
+    auto hi = _mm256_mullo_epi16(_mm256_unpackhi_epi8(p, zero), _mm256_unpackhi_epi8(a, zero));
+    return _mm256_packus_epi16(div255(lo), div255(hi));
+}
+
+__attribute__((target("avx2")))
+void blendAvx2(uint32_t* dst, const uint32_t* src, size_t count, uint8_t alpha) {
+    const auto broadcastAlpha = _mm256_setr_epi8(
+        3, 3, 3, 3, 7, 7, 7, 7, 11, 11, 11, 11, 15, 15, 15, 15,
+        3, 3, 3, 3, 7, 7, 7, 7, 11, 11, 11, 11, 15, 15, 15, 15);
+    const auto planeAlpha = _mm256_set1_epi8(static_cast<char>(alpha));
+    const auto ones = _mm256_set1_epi8(-1);
+
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        auto s = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+        auto d = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(dst + i));
+        if (alpha != 255)
+            s = scale(s, planeAlpha);
+
+        auto inverse = _mm256_xor_si256(_mm256_shuffle_epi8(s, broadcastAlpha), ones);
+        d = _mm256_adds_epu8(s, scale(d, inverse));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), d);
+    }
+    blendSse4(dst + i, src + i, count - i, alpha);
+}
+
+__attribute__((target("avx2")))
+void swapAvx2(uint32_t* dst, const uint32_t* src, size_t count) {
+    const auto order = _mm256_setr_epi8(
+        2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15,
+        2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        auto s = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), _mm256_shuffle_epi8(s, order));
+    }
+    swapSse4(dst + i, src + i, count - i);
+}
+
+constexpr BlendKernels AVX2{"avx2", copyScalar, fillScalar, blendAvx2, swapAvx2};
+
+#endif
+
+#ifdef BLEND_NEON
+
+/* NEON (8 pixels) */
+
+// (x + ((x + 128) >> 8) + 128) >> 8, same as the scalar version
+inline uint8x8_t scale(uint8x8_t c, uint8x8_t a) {
+    auto x = vmull_u8(c, a);
+    return vraddhn_u16(x, vrshrq_n_u16(x, 8));
+}
+
+void blendNeon(uint32_t* dst, const uint32_t* src, size_t count, uint8_t alpha) {
+    const auto planeAlpha = vdup_n_u8(alpha);
+
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        // De-interleave the channels, the alpha channel is the last one
+        auto s = vld4_u8(reinterpret_cast<const uint8_t*>(src + i));
+        auto d = vld4_u8(reinterpret_cast<uint8_t*>(dst + i));
+        if (alpha != 255) {
+            for (auto& c : s.val)
+                c = scale(c, planeAlpha);
+        }
+
+        auto inverse = vmvn_u8(s.val[3]);
+        for (int c = 0; c < 4; ++c)
+            d.val[c] = vqadd_u8(s.val[c], scale(d.val[c], inverse));
+        vst4_u8(reinterpret_cast<uint8_t*>(dst + i), d);
+    }
+    blendScalar(dst + i, src + i, count - i, alpha);
+}
+
+void swapNeon(uint32_t* dst, const uint32_t* src, size_t count) {
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        auto s = vld4q_u8(reinterpret_cast<const uint8_t*>(src + i));
+        std::swap(s.val[0], s.val[2]);
+        vst4q_u8(reinterpret_cast<uint8_t*>(dst + i), s);
+    }
+    swapScalar(dst + i, src + i, count - i);
+}
+
+constexpr BlendKernels NEON{"neon", copyScalar, fillScalar, blendNeon, swapNeon};
+
+#endif
+}
+
+std::vector<const BlendKernels*> availableBlendKernels() {
+    std::vector<const BlendKernels*> kernels{&SCALAR};
+#ifdef BLEND_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.1"))
+        kernels.push_back(&SSE4);
+    if (__builtin_cpu_supports("avx2"))
+        kernels.push_back(&AVX2);
+#endif
+#ifdef BLEND_NEON
+    kernels.push_back(&NEON);
+#endif
+    return kernels;
+}
+
+const BlendKernels& blendKernels() {
+    static const auto& best = *availableBlendKernels().back();
+    return best;
+}
+
+}  // namespace drmfb
+}  // namespace V2_1
+}  // namespace composer
+}  // namespace graphics
+}  // namespace hardware
+}  // namespace android
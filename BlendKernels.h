@@ -0,0 +1,44 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (C) 2019 Stephan Gerhold
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace android {
+namespace hardware {
+namespace graphics {
+namespace composer {
+namespace V2_1 {
+namespace drmfb {
+
+/*
+ * Row kernels for software composition. Pixels are 32-bit with the alpha
+ * channel in the upper byte (e.g. ABGR8888) and premultiplied alpha.
+ * The order of the color channels does not matter, as long as it is the same
+ * for the source and destination.
+ */
+struct BlendKernels {
+    const char* name;
+
+    void (*copy)(uint32_t* dst, const uint32_t* src, size_t count);
+    void (*fill)(uint32_t* dst, uint32_t color, size_t count);
+    // Source over: dst = src * alpha + dst * (1 - src.a * alpha)
+    void (*blend)(uint32_t* dst, const uint32_t* src, size_t count, uint8_t alpha);
+    // Copy with the first and third channel swapped (e.g. RGBA <-> BGRA)
+    void (*swap)(uint32_t* dst, const uint32_t* src, size_t count);
+};
+
+// The fastest kernels supported by the CPU
+const BlendKernels& blendKernels();
+// All kernels supported by the CPU (the first one is the scalar reference)
+std::vector<const BlendKernels*> availableBlendKernels();
+
+}  // namespace drmfb
+}  // namespace V2_1
+}  // namespace composer
+}  // namespace graphics
+}  // namespace hardware
+}  // namespace android
@@ -0,0 +1,140 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (C) 2019 Stephan Gerhold
+
+#define LOG_TAG "drmfb-commit"
+
+#include <algorithm>
+#include <utility>
+#include <time.h>
+#include <android-base/logging.h>
+#include <android-base/properties.h>
+#include <sync/sync.h>
+#include "DrmCommitThread.h"
+#include "DrmDisplay.h"
+#include "SoftwareCompositor.h"
+
+namespace android {
+namespace hardware {
+namespace graphics {
+namespace composer {
+namespace V2_1 {
+namespace drmfb {
+
+namespace {
+constexpr size_t MAX_DEPTH = 8;
+
+int64_t now() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return int64_t{ts.tv_sec} * 1'000'000'000 + ts.tv_nsec;
+}
+}
+
+DrmCommitThread::DrmCommitThread(DrmDisplay& display)
+    : GraphicsThread("drm-commit-" + std::to_string(display.connector()), ThreadClass::COMMIT),
+      mDisplay(display),
+      mDepth(std::max<size_t>(1,
+          base::GetUintProperty<size_t>("hwc.drm.commit.depth", 1, MAX_DEPTH))),
+      mMailbox(base::GetBoolProperty("hwc.drm.commit.mailbox", false)) {}
+
+void DrmCommitThread::queue(std::shared_ptr<const DrmFramebuffer> fb,
+        base::unique_fd acquireFence, uint32_t sequence, bool damaged, bool bypassColorTransform,
+        std::shared_ptr<SoftwareFrame> frame, bool replace) {
+    std::unique_lock lock{mQueueMutex};
+    if ((mMailbox || replace) && mQueue.size() >= mDepth) {
+        /*
+         * Replace the stale frame, it was never displayed. Its present fence
+         * signals together with the new frame since the sequence is higher.
+         * An unchanged frame still needs to be rendered if it was not yet.
+         */
+        auto& last = mQueue.back();
+        if (!frame && last.framebuffer == fb) {
+            frame = std::move(last.frame);
+            damaged = damaged || last.damaged;
+        }
+        last = {std::move(fb), std::move(acquireFence), sequence, damaged, bypassColorTransform,
+                0, std::move(frame)};
+        return;
+    }
+
+    mQueueCondition.wait(lock, [this] { return mQueue.size() < mDepth; });
+    auto wakeup = mQueue.empty() && !mCommitting ? now() : 0;
+    mQueue.push_back({std::move(fb), std::move(acquireFence), sequence, damaged,
+                      bypassColorTransform, wakeup, std::move(frame)});
+
+    /*
+     * The thread is disabled with the queue lock held once the queue
+     * is empty, so enabling it here cannot race with that.
+     */
+    enable();
+}
+
+void DrmCommitThread::queueCursor(base::unique_fd source, const BufferInfo& info,
+        base::unique_fd acquireFence, uint32_t sequence) {
+    std::scoped_lock lock{mQueueMutex};
+    mCursor = Cursor{std::move(source), info, std::move(acquireFence), sequence};
+    enable();
+}
+
+void DrmCommitThread::flush() {
+    std::unique_lock lock{mQueueMutex};
+    mQueue.clear();
+    if (mCursor) {
+        mDisplay.releaseCursor(mCursor->sequence);
+        mCursor.reset();
+    }
+    mQueueCondition.wait(lock, [this] { return !mCommitting; });
+    mQueueCondition.notify_all();
+}
+
+void DrmCommitThread::run() {
+    Commit commit;
+    std::optional<Cursor> cursor;
+    {
+        std::scoped_lock lock{mQueueMutex};
+        if (mQueue.empty() && !mCursor) {
+            // Nothing to commit, sleep until the next frame is queued
+            disable();
+            return;
+        }
+
+        // A cursor copy in progress also counts, flush() releases the next one
+        cursor = std::exchange(mCursor, std::nullopt);
+        if (!mQueue.empty()) {
+            commit = std::move(mQueue.front());
+            mQueue.pop_front();
+        }
+        mCommitting = true;
+    }
+    mQueueCondition.notify_all();
+
+    if (cursor)
+        mDisplay.updateCursor(cursor->info, std::move(cursor->acquireFence), cursor->sequence);
+
+    if (commit.framebuffer) {
+        if (commit.wakeup)
+            recordWakeup(commit.wakeup);
+
+        if (commit.acquireFence >= 0 && sync_wait(commit.acquireFence, -1)) {
+            PLOG(ERROR) << "Failed to wait for acquire fence of display " << mDisplay;
+        }
+        if (commit.frame)
+            commit.frame->render();
+
+        mDisplay.commit(std::move(commit.framebuffer), commit.sequence, commit.damaged,
+                        commit.bypassColorTransform);
+    }
+
+    {
+        std::scoped_lock lock{mQueueMutex};
+        mCommitting = false;
+    }
+    mQueueCondition.notify_all();
+}
+
+}  // namespace drmfb
+}  // namespace V2_1
+}  // namespace composer
+}  // namespace graphics
+}  // namespace hardware
+}  // namespace android
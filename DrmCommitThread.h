@@ -0,0 +1,83 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (C) 2019 Stephan Gerhold
+
+#pragma once
+
+#include <deque>
+#include <memory>
+#include <optional>
+#include <android-base/unique_fd.h>
+#include "DrmFramebufferImporter.h"
+#include "GraphicsThread.h"
+
+namespace android {
+namespace hardware {
+namespace graphics {
+namespace composer {
+namespace V2_1 {
+namespace drmfb {
+
+struct DrmDisplay;
+struct DrmFramebuffer;
+struct SoftwareFrame;
+
+/*
+ * Commits frames to a display asynchronously: Frames are queued together
+ * with their acquire fence, the thread waits for the fence and performs
+ * the page flip once the CRTC is free again. Cursor buffers are copied
+ * and frames of the software compositor are rendered on the thread as well,
+ * once their acquire fences have signaled.
+ */
+struct DrmCommitThread : public GraphicsThread {
+    DrmCommitThread(DrmDisplay& display);
+
+    // Blocks while the queue is full, unless mailbox mode is enabled or replace is set
+    void queue(std::shared_ptr<const DrmFramebuffer> fb, base::unique_fd acquireFence,
+               uint32_t sequence, bool damaged, bool bypassColorTransform,
+               std::shared_ptr<SoftwareFrame> frame, bool replace = false);
+    // Replaces a cursor update that was not handled yet, source is a dup of the dma-buf
+    void queueCursor(base::unique_fd source, const BufferInfo& info,
+                     base::unique_fd acquireFence, uint32_t sequence);
+    void flush();
+
+protected:
+    void run() override;
+
+private:
+    struct Commit {
+        std::shared_ptr<const DrmFramebuffer> framebuffer;
+        base::unique_fd acquireFence;
+        uint32_t sequence = 0; // Present fence timeline value
+        bool damaged = true; // False if the buffer did not change while it was displayed
+        bool bypassColorTransform = false; // Already applied by the client
+        int64_t wakeup = 0; // When the idle thread was woken up for the commit
+        std::shared_ptr<SoftwareFrame> frame; // Rendered into the framebuffer first
+    };
+    struct Cursor {
+        base::unique_fd source; // The buffer handle might be freed before the copy
+        BufferInfo info;
+        base::unique_fd acquireFence;
+        uint32_t sequence; // To ignore updates of a cursor that was hidden meanwhile
+    };
+
+    DrmDisplay& mDisplay;
+
+    // Maximum number of frames waiting to be committed
+    const size_t mDepth;
+    // Replace the last queued frame instead of waiting if the queue is full
+    const bool mMailbox;
+
+    // Protects the queue (separate from the lock of GraphicsThread, which enables the thread)
+    std::mutex mQueueMutex;
+    std::condition_variable mQueueCondition;
+    std::deque<Commit> mQueue;
+    std::optional<Cursor> mCursor; // Only the latest cursor buffer is copied
+    bool mCommitting = false;
+};
+
+}  // namespace drmfb
+}  // namespace V2_1
+}  // namespace composer
+}  // namespace graphics
+}  // namespace hardware
+}  // namespace android
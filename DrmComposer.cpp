@@ -3,10 +3,16 @@
 
 #define LOG_TAG "drmfb-composer"
 
+#include <algorithm>
+#include <cstring>
 #include <numeric>
+#include <sstream>
+#include <dirent.h>
+#include <unistd.h>
 #include <android-base/logging.h>
-#include <composer-hal/2.1/Composer.h>
+#include <android-base/properties.h>
 #include <sync/sync.h>
+#include <composer-hal/2.1/Composer.h>
 #include "DrmComposer.h"
 #include "DrmComposerHal.h"
 
@@ -17,43 +23,159 @@ namespace composer {
 namespace V2_1 {
 namespace drmfb {
 
+namespace {
+constexpr auto DRI_PATH = "/dev/dri";
+constexpr uint32_t MAX_VIRTUAL_DISPLAYS = 4;
+
+// Physical display IDs only use the lower 32 bits and the index of the device
+constexpr Display VIRTUAL_DISPLAY = Display{1} << 63;
+
+bool operator==(const hwc_rect_t& a, const hwc_rect_t& b) {
+    return a.left == b.left && a.top == b.top && a.right == b.right && a.bottom == b.bottom;
+}
+
+bool operator==(const hwc_frect_t& a, const hwc_frect_t& b) {
+    return a.left == b.left && a.top == b.top && a.right == b.right && a.bottom == b.bottom;
+}
+
+// Returns true if the value has changed
+template<typename T>
+bool change(T* value, const T& newValue) {
+    if (*value == newValue)
+        return false;
+    *value = newValue;
+    return true;
+}
+
+// Primary DRM nodes, devices without mode setting support fail to initialize later
+std::vector<std::string> findDevices() {
+    auto path = base::GetProperty("hwc.drm.device", "");
+    if (!path.empty())
+        return {path};
+
+    std::vector<std::string> paths;
+    std::unique_ptr<DIR, decltype(&closedir)> dir{opendir(DRI_PATH), closedir};
+    if (!dir) {
+        PLOG(ERROR) << "Failed to open " << DRI_PATH;
+        return {};
+    }
+    while (auto entry = readdir(dir.get())) {
+        if (!strncmp(entry->d_name, "card", strlen("card")))
+            paths.push_back(std::string{DRI_PATH} + '/' + entry->d_name);
+    }
+
+    // Keep the order stable (card0 first), the first device has the primary display
+    std::sort(paths.begin(), paths.end(), [] (const auto& a, const auto& b) {
+        return a.size() != b.size() ? a.size() < b.size() : a < b;
+    });
+    return paths;
+}
+}
+
 android::sp<IComposer> createDrmComposer() {
-    auto device = std::make_unique<DrmDevice>();
-    if (!device->initialize()) {
+    std::vector<std::unique_ptr<DrmDevice>> devices;
+    for (const auto& path : findDevices()) {
+        auto device = std::make_unique<DrmDevice>(path, devices.size());
+        if (device->initialize()) {
+            LOG(INFO) << "Using DRM device " << path << " (index " << device->index() << ")";
+            devices.push_back(std::move(device));
+        } else {
+            LOG(WARNING) << "Skipping DRM device " << path;
+        }
+    }
+
+    if (devices.empty()) {
+        LOG(ERROR) << "No usable DRM device found";
         return {};
     }
 
-    return new hal::Composer{std::make_unique<DrmComposerHal>(std::move(device))};
+    return new hal::Composer{std::make_unique<DrmComposerHal>(std::move(devices))};
 }
 
-DrmComposerHal::DrmComposerHal(std::unique_ptr<DrmDevice> device)
-    : mDevice(std::move(device)) {}
+DrmComposerHal::DrmComposerHal(std::vector<std::unique_ptr<DrmDevice>> devices)
+    : mDevices(std::move(devices)),
+      mCpuComposition(base::GetBoolProperty("hwc.drm.composition.cpu", false)),
+      mMirror(base::GetBoolProperty("hwc.drm.mirror", false)),
+      mMaxVirtualDisplays(base::GetUintProperty<uint32_t>("hwc.drm.virtual.max", 1,
+          MAX_VIRTUAL_DISPLAYS)),
+      mColorTransforms(std::all_of(mDevices.begin(), mDevices.end(),
+          [] (const auto& device) { return device->colorTransforms(); })),
+      mDiagonalColorTransforms(std::all_of(mDevices.begin(), mDevices.end(),
+          [] (const auto& device) { return device->colorTransforms(true); })) {}
 
 bool DrmComposerHal::hasCapability(hwc2_capability_t capability) {
-    // TODO: Is there a way to implement them without atomic modesetting?
-    return static_cast<IComposer::Capability>(capability)
-                == IComposer::Capability::PRESENT_FENCE_IS_NOT_RELIABLE;
+    // Not part of IComposer::Capability, but used by the command engine for presentOrValidate
+    if (capability == HWC2_CAPABILITY_SKIP_VALIDATE)
+        return true; // presentDisplay() fails with NOT_VALIDATED if anything has changed
+
+    switch (static_cast<IComposer::Capability>(capability)) {
+    case IComposer::Capability::SKIP_CLIENT_COLOR_TRANSFORM:
+        return mColorTransforms;
+    case IComposer::Capability::PRESENT_FENCE_IS_NOT_RELIABLE:
+        // Present fences are emulated using sw_sync, if it is available
+        return !std::all_of(mDevices.begin(), mDevices.end(),
+            [] (const auto& device) { return device->presentFences(); });
+    default:
+        return false;
+    }
 }
 
 std::string DrmComposerHal::dumpDebugInfo() {
-    return ""; // TODO
+    std::ostringstream os;
+    os << "drmfb-composer:\n";
+    for (const auto& device : mDevices) {
+        os << "  Device " << device->index() << ":\n"
+           << "    Framebuffer cache: " << device->framebuffers() << "\n"
+           << "    Wakeup latency:\n";
+        device->dumpWakeupLatency(os, "      ");
+    }
+    return os.str();
 }
 
 void DrmComposerHal::registerEventCallback(EventCallback* callback) {
     mCallback = callback;
-    mDevice->enable(this);
+    for (auto& device : mDevices)
+        device->enable(this);
 }
 
 void DrmComposerHal::unregisterEventCallback() {
     LOG(INFO) << "Client destroyed, disabling displays";
-    mDevice->disable();
+    for (auto& device : mDevices)
+        device->disable();
 
     mCallback = nullptr;
-    mLayers.clear();
-    mNextLayer = 0;
+
+    std::scoped_lock lock{mDisplaysMutex};
+    mDisplays.clear();
+    mMirrors.clear();
+    mVirtualDisplays = 0;
 }
 
 void DrmComposerHal::onHotplug(const DrmDisplay& display, bool connected) {
+    {
+        std::scoped_lock lock{mDisplaysMutex};
+        auto mirror = std::find_if(mMirrors.begin(), mMirrors.end(),
+            [&display] (const auto& mirror) { return mirror.id == display.id(); });
+        if (mirror != mMirrors.end()) {
+            if (!connected)
+                mMirrors.erase(mirror);
+            return;
+        }
+
+        if (connected) {
+            auto reported = std::any_of(mDisplays.begin(), mDisplays.end(),
+                [] (const auto& entry) { return !entry.second->isVirtual; });
+            if (mMirror && reported && !mDisplays.count(display.id())) {
+                LOG(INFO) << "Mirroring to display " << display;
+                mMirrors.push_back({display.id()});
+                return;
+            }
+            mDisplays.try_emplace(display.id(), std::make_shared<HwcDisplay>());
+        } else {
+            mDisplays.erase(display.id());
+        }
+    }
+
     mCallback->onHotplug(display.id(),
         connected ? IComposerCallback::Connection::CONNECTED
             : IComposerCallback::Connection::DISCONNECTED);
@@ -64,41 +186,194 @@ void DrmComposerHal::onVsync(const DrmDisplay& display, int64_t timestamp) {
 }
 
 uint32_t DrmComposerHal::getMaxVirtualDisplayCount() {
-    return 0; // Not supported
+    return mMaxVirtualDisplays;
+}
+
+Error DrmComposerHal::createVirtualDisplay(uint32_t width, uint32_t height,
+        PixelFormat* format, Display* outDisplayId) {
+    // The client target is copied, so only RGBA and BGRA are supported
+    if (*format != PixelFormat::RGBA_8888 && *format != PixelFormat::RGBX_8888
+            && *format != PixelFormat::BGRA_8888)
+        *format = PixelFormat::RGBA_8888;
+
+    auto hwcDisplay = std::make_shared<HwcDisplay>();
+    hwcDisplay->isVirtual = true;
+    hwcDisplay->width = width;
+    hwcDisplay->height = height;
+    hwcDisplay->copyThread = std::make_unique<VirtualDisplayThread>();
+
+    std::scoped_lock lock{mDisplaysMutex};
+    if (mVirtualDisplays >= mMaxVirtualDisplays)
+        return Error::NO_RESOURCES;
+
+    *outDisplayId = VIRTUAL_DISPLAY | ++mNextVirtualDisplay;
+    mDisplays.emplace(*outDisplayId, std::move(hwcDisplay));
+    ++mVirtualDisplays;
+
+    LOG(INFO) << "Created virtual display " << *outDisplayId
+        << " (" << width << "x" << height << ")";
+    return Error::NONE;
+}
+
+Error DrmComposerHal::destroyVirtualDisplay(Display displayId) {
+    // Stopping its copy thread may wait for a copy, so the lock must not be held
+    std::shared_ptr<HwcDisplay> hwcDisplay;
+    {
+        std::scoped_lock lock{mDisplaysMutex};
+        auto i = mDisplays.find(displayId);
+        if (i == mDisplays.end() || !i->second->isVirtual)
+            return Error::BAD_DISPLAY;
+
+        hwcDisplay = std::move(i->second);
+        mDisplays.erase(i);
+        --mVirtualDisplays;
+    }
+    return Error::NONE;
+}
+
+std::shared_ptr<DrmDisplay> DrmComposerHal::getConnectedDisplay(Display displayId) {
+    // The upper 32 bits are the index of the device, the lower ones the connector
+    auto index = displayId >> 32;
+    if (index >= mDevices.size())
+        return nullptr;
+    return mDevices[index]->getConnectedDisplay(static_cast<uint32_t>(displayId));
 }
 
-Error DrmComposerHal::createVirtualDisplay(uint32_t /*width*/, uint32_t /*height*/,
-        PixelFormat* /*format*/, Display* /*outDisplayId*/) {
-    return Error::NO_RESOURCES;
+std::vector<std::shared_ptr<DrmDisplay>> DrmComposerHal::getMirrors(const DrmDisplay* source) {
+    std::vector<std::shared_ptr<DrmDisplay>> mirrors, enabled;
+    {
+        std::scoped_lock lock{mDisplaysMutex};
+        for (auto& mirror : mMirrors) {
+            auto display = getConnectedDisplay(mirror.id);
+            if (!display)
+                continue;
+
+            // Only try once, not on each frame if no CRTC is available
+            if (source && !mirror.enabled) {
+                mirror.enabled = true;
+                enabled.push_back(display);
+            }
+            mirrors.push_back(std::move(display));
+        }
+    }
+
+    if (enabled.empty())
+        return mirrors;
+
+    // Prefer the same refresh rate, so the mirrors do not drop or repeat frames
+    auto mode = source->currentMode();
+    auto width = source->width(mode), height = source->height(mode);
+    auto vsyncPeriod = source->vsyncPeriod(mode);
+
+    // Might move other displays to another CRTC, so the lock must not be held
+    for (auto& display : enabled) {
+        display->setMode(display->findMode(width, height, vsyncPeriod));
+        display->enable();
+    }
+    return mirrors;
+}
+
+base::unique_fd DrmComposerHal::present(DrmDisplay& display,
+        std::shared_ptr<const DrmFramebuffer> fb, buffer_handle_t buffer,
+        base::unique_fd acquireFence, bool damaged, std::shared_ptr<SoftwareFrame> frame) {
+    if (!mMirror)
+        return display.present(std::move(fb), std::move(acquireFence), damaged, std::move(frame));
+
+    std::vector<base::unique_fd> fences;
+    for (auto& mirror : getMirrors(&display)) {
+        if (!mirror->hasCrtc())
+            continue;
+
+        // Displays of the same device can scan out the same framebuffer
+        std::shared_ptr<const DrmFramebuffer> mirrorFb;
+        if (&mirror->device() == &display.device())
+            mirrorFb = fb;
+        else if (buffer)
+            mirrorFb = mirror->device().framebuffers().get(buffer);
+        else
+            continue; // Composed using the CPU into a dumb buffer of the other device
+
+        // A slower mirror drops frames instead of blocking until its queue has space
+        fences.push_back(mirror->present(std::move(mirrorFb),
+            base::unique_fd{acquireFence >= 0 ? dup(acquireFence) : -1}, damaged, frame,
+            true));
+    }
+
+    /*
+     * The present fence also releases the buffers, so it must not signal
+     * before the previous frame was replaced on all mirrors.
+     */
+    auto presentFence = display.present(std::move(fb), std::move(acquireFence), damaged,
+                                        std::move(frame));
+    for (auto& fence : fences) {
+        if (presentFence < 0 || fence < 0)
+            continue;
+        if (auto merged = sync_merge("drmfb-mirror", presentFence, fence); merged >= 0)
+            presentFence.reset(merged);
+        else
+            PLOG(ERROR) << "Failed to merge present fences of mirrored displays";
+    }
+    return presentFence;
 }
 
-Error DrmComposerHal::destroyVirtualDisplay(Display /*displayId*/) {
-    return Error::BAD_DISPLAY;
+std::shared_ptr<DrmComposerHal::HwcDisplay> DrmComposerHal::getHwcDisplay(Display displayId) {
+    std::scoped_lock lock{mDisplaysMutex};
+    auto i = mDisplays.find(displayId);
+    return i != mDisplays.end() ? i->second : nullptr;
+}
+
+bool DrmComposerHal::hasDisplay(Display displayId) {
+    if (displayId & VIRTUAL_DISPLAY)
+        return !!getHwcDisplay(displayId);
+    return !!getConnectedDisplay(displayId);
+}
+
+template<typename F>
+Error DrmComposerHal::updateLayer(Display displayId, Layer layer, F update) {
+    auto hwcDisplay = getHwcDisplay(displayId);
+    if (!hwcDisplay)
+        return Error::BAD_DISPLAY;
+
+    std::scoped_lock lock{hwcDisplay->mutex};
+    auto i = hwcDisplay->layers.find(layer);
+    if (i == LayerTable::NONE)
+        return Error::BAD_LAYER;
+
+    if (update(hwcDisplay->layers, i))
+        hwcDisplay->validated = false;
+    return Error::NONE;
 }
 
 Error DrmComposerHal::createLayer(Display displayId, Layer* outLayer) {
-    if (!mDevice->getConnectedDisplay(displayId))
+    auto hwcDisplay = getHwcDisplay(displayId);
+    if (!hwcDisplay)
         return Error::BAD_DISPLAY;
 
-    *outLayer = mNextLayer++;
-    mLayers.emplace(*outLayer, displayId);
+    std::scoped_lock lock{hwcDisplay->mutex};
+    *outLayer = hwcDisplay->layers.create();
+    hwcDisplay->validated = false;
     return Error::NONE;
 }
 
 Error DrmComposerHal::destroyLayer(Display displayId, Layer layer) {
-    auto i = mLayers.find(layer);
-    if (i == mLayers.end())
-        return Error::BAD_LAYER;
-    if (displayId != i->second.displayId)
+    auto hwcDisplay = getHwcDisplay(displayId);
+    if (!hwcDisplay)
         return Error::BAD_DISPLAY;
 
-    mLayers.erase(i);
-    return Error::NONE;
+    std::scoped_lock lock{hwcDisplay->mutex};
+    if (hwcDisplay->cursor == layer)
+        hwcDisplay->cursor.reset();
+    if (hwcDisplay->scanout == layer)
+        hwcDisplay->scanout.reset();
+    if (hwcDisplay->presentedScanout == layer)
+        hwcDisplay->presentedScanout.reset();
+    hwcDisplay->validated = false;
+    return hwcDisplay->layers.destroy(layer) ? Error::NONE : Error::BAD_LAYER;
 }
 
 
 Error DrmComposerHal::getActiveConfig(Display displayId, Config* outConfig) {
-    auto display = mDevice->getConnectedDisplay(displayId);
+    auto display = getConnectedDisplay(displayId);
     if (!display)
         return Error::BAD_DISPLAY;
 
@@ -108,18 +383,28 @@ Error DrmComposerHal::getActiveConfig(Display displayId, Config* outConfig) {
 
 Error DrmComposerHal::getClientTargetSupport(Display displayId,
         uint32_t width, uint32_t height, PixelFormat format, Dataspace dataspace) {
-    auto display = mDevice->getConnectedDisplay(displayId);
-    if (!display)
-        return Error::BAD_DISPLAY;
+    uint32_t displayWidth, displayHeight;
+    if (displayId & VIRTUAL_DISPLAY) {
+        auto hwcDisplay = getHwcDisplay(displayId);
+        if (!hwcDisplay)
+            return Error::BAD_DISPLAY;
+        displayWidth = hwcDisplay->width;
+        displayHeight = hwcDisplay->height;
+    } else {
+        auto display = getConnectedDisplay(displayId);
+        if (!display)
+            return Error::BAD_DISPLAY;
+        displayWidth = display->width(display->currentMode());
+        displayHeight = display->height(display->currentMode());
+    }
 
-    return width == static_cast<uint32_t>(display->width(display->currentMode()))
-        && height == static_cast<uint32_t>(display->height(display->currentMode()))
+    return width == displayWidth && height == displayHeight
         && format == PixelFormat::RGBA_8888 && dataspace == Dataspace::UNKNOWN
             ? Error::NONE : Error::UNSUPPORTED;
 }
 
 Error DrmComposerHal::getColorModes(Display displayId, hidl_vec<ColorMode>* outModes) {
-    if (!mDevice->getConnectedDisplay(displayId))
+    if (!hasDisplay(displayId))
         return Error::BAD_DISPLAY;
 
     *outModes = hidl_vec<ColorMode>{ColorMode::NATIVE};
@@ -128,7 +413,7 @@ Error DrmComposerHal::getColorModes(Display displayId, hidl_vec<ColorMode>* outM
 
 Error DrmComposerHal::getDisplayAttribute(Display displayId, Config config,
         IComposerClient::Attribute attribute, int32_t* outValue) {
-    auto display = mDevice->getConnectedDisplay(displayId);
+    auto display = getConnectedDisplay(displayId);
     if (!display)
         return Error::BAD_DISPLAY;
 
@@ -163,7 +448,7 @@ Error DrmComposerHal::getDisplayAttribute(Display displayId, Config config,
 }
 
 Error DrmComposerHal::getDisplayConfigs(Display displayId, hidl_vec<Config>* outConfigs) {
-    auto display = mDevice->getConnectedDisplay(displayId);
+    auto display = getConnectedDisplay(displayId);
     if (!display)
         return Error::BAD_DISPLAY;
 
@@ -173,7 +458,14 @@ Error DrmComposerHal::getDisplayConfigs(Display displayId, hidl_vec<Config>* out
 }
 
 Error DrmComposerHal::getDisplayName(Display displayId, hidl_string* outName) {
-    auto display = mDevice->getConnectedDisplay(displayId);
+    if (displayId & VIRTUAL_DISPLAY) {
+        if (!getHwcDisplay(displayId))
+            return Error::BAD_DISPLAY;
+        *outName = "Virtual";
+        return Error::NONE;
+    }
+
+    auto display = getConnectedDisplay(displayId);
     if (!display)
         return Error::BAD_DISPLAY;
 
@@ -182,39 +474,54 @@ Error DrmComposerHal::getDisplayName(Display displayId, hidl_string* outName) {
 }
 
 Error DrmComposerHal::getDisplayType(Display displayId, IComposerClient::DisplayType* outType) {
-    if (!mDevice->getConnectedDisplay(displayId))
+    if (!hasDisplay(displayId))
         return Error::BAD_DISPLAY;
 
-    *outType = IComposerClient::DisplayType::PHYSICAL;
+    *outType = displayId & VIRTUAL_DISPLAY ? IComposerClient::DisplayType::VIRTUAL
+        : IComposerClient::DisplayType::PHYSICAL;
     return Error::NONE;
 }
 
 Error DrmComposerHal::getDozeSupport(Display displayId, bool* outSupport) {
-    if (!mDevice->getConnectedDisplay(displayId))
+    if (!hasDisplay(displayId))
         return Error::BAD_DISPLAY;
 
-    *outSupport = false;
+    *outSupport = true; // DOZE is the same as ON, DOZE_SUSPEND uses DPMS
     return Error::NONE;
 }
 
 Error DrmComposerHal::getHdrCapabilities(Display displayId, hidl_vec<Hdr>* /*outTypes*/,
         float* /*outMaxLuminance*/, float* /*outMaxAverageLuminance*/, float* /*outMinLuminance*/) {
-    if (!mDevice->getConnectedDisplay(displayId))
+    if (!hasDisplay(displayId))
         return Error::BAD_DISPLAY;
 
     return Error::NONE;
 }
 
 Error DrmComposerHal::setActiveConfig(Display displayId, Config config) {
-    auto display = mDevice->getConnectedDisplay(displayId);
-    if (!display)
+    auto display = getConnectedDisplay(displayId);
+    auto hwcDisplay = getHwcDisplay(displayId);
+    if (!display || !hwcDisplay)
         return Error::BAD_DISPLAY;
 
-    return display->setMode(config) ? Error::NONE : Error::BAD_CONFIG;
+    {
+        std::scoped_lock lock{hwcDisplay->mutex};
+        hwcDisplay->validated = false; // Layers might no longer cover the whole display
+        if (!display->setMode(config))
+            return Error::BAD_CONFIG;
+    }
+
+    if (mMirror) {
+        // Pick the modes of the mirrors again with the next frame
+        std::scoped_lock lock{mDisplaysMutex};
+        for (auto& mirror : mMirrors)
+            mirror.enabled = false;
+    }
+    return Error::NONE;
 }
 
 Error DrmComposerHal::setColorMode(Display displayId, ColorMode mode) {
-    if (!mDevice->getConnectedDisplay(displayId))
+    if (!hasDisplay(displayId))
         return Error::BAD_DISPLAY;
     if (mode != ColorMode::NATIVE)
         return Error::UNSUPPORTED;
@@ -223,26 +530,52 @@ Error DrmComposerHal::setColorMode(Display displayId, ColorMode mode) {
 }
 
 Error DrmComposerHal::setPowerMode(Display displayId, IComposerClient::PowerMode mode) {
-    auto display = mDevice->getConnectedDisplay(displayId);
+    auto display = getConnectedDisplay(displayId);
     if (!display)
         return Error::BAD_DISPLAY;
 
+    /*
+     * Turning the display off using DPMS keeps the CRTC and the mode,
+     * so it can be turned on again quickly (without a full mode set).
+     * The CRTC is only disabled if DPMS is not available.
+     */
+    auto suspend = [this, &display] (uint64_t dpms, bool disable) {
+        std::vector<std::shared_ptr<DrmDisplay>> displays{display};
+        if (mMirror) {
+            auto mirrors = getMirrors();
+            displays.insert(displays.end(), mirrors.begin(), mirrors.end());
+
+            // Turned on again with the next frame
+            std::scoped_lock lock{mDisplaysMutex};
+            for (auto& mirror : mMirrors)
+                mirror.enabled = false;
+        }
+        for (auto& d : displays) {
+            if (!d->setDpms(dpms) && disable)
+                d->disable();
+        }
+    };
+
     switch (mode) {
     case IComposerClient::PowerMode::OFF:
-        display->disable();
+        suspend(DRM_MODE_DPMS_OFF, true);
+        return Error::NONE;
+    case IComposerClient::PowerMode::DOZE_SUSPEND:
+        // Without DPMS, the last frame simply stays on the display
+        if (!display->hasCrtc() && !display->enable())
+            return Error::NO_RESOURCES;
+        suspend(DRM_MODE_DPMS_SUSPEND, false);
         return Error::NONE;
     case IComposerClient::PowerMode::ON:
+    case IComposerClient::PowerMode::DOZE: // There is no low power mode, same as on
         return display->enable() ? Error::NONE : Error::NO_RESOURCES;
-    case IComposerClient::PowerMode::DOZE:
-    case IComposerClient::PowerMode::DOZE_SUSPEND:
-        return Error::UNSUPPORTED;
     default:
         return Error::BAD_PARAMETER;
     }
 }
 
 Error DrmComposerHal::setVsyncEnabled(Display displayId, IComposerClient::Vsync enabled) {
-    auto display = mDevice->getConnectedDisplay(displayId);
+    auto display = getConnectedDisplay(displayId);
     if (!display)
         return Error::BAD_DISPLAY;
 
@@ -258,123 +591,466 @@ Error DrmComposerHal::setVsyncEnabled(Display displayId, IComposerClient::Vsync
     }
 }
 
-Error DrmComposerHal::setColorTransform(Display /*displayId*/,
-        const float* /*matrix*/, int32_t /*hint*/) {
-    return Error::UNSUPPORTED;
+Error DrmComposerHal::setColorTransform(Display displayId, const float* matrix, int32_t hint) {
+    auto hwcDisplay = getHwcDisplay(displayId);
+    if (!hwcDisplay)
+        return Error::BAD_DISPLAY;
+
+    /*
+     * Applied by the CRTC, for all layers (including client composition).
+     * Matrices that only scale and offset each channel (e.g. night light)
+     * only need a gamma LUT, others need a CTM as well.
+     */
+    auto identity = hint == HAL_COLOR_TRANSFORM_IDENTITY;
+    auto hardware = identity || mColorTransforms
+        || (mDiagonalColorTransforms && DrmDisplay::diagonalColorTransform(matrix));
+    if (auto display = getConnectedDisplay(displayId))
+        display->setColorTransform(identity || !hardware ? nullptr : matrix);
+    if (mMirror) {
+        for (auto& mirror : getMirrors())
+            mirror->setColorTransform(identity || !hardware ? nullptr : matrix);
+    }
+
+    // Otherwise, all layers must be composed by the client to apply it
+    std::scoped_lock lock{hwcDisplay->mutex};
+    if (change(&hwcDisplay->clientColorTransform, !hardware))
+        hwcDisplay->validated = false;
+    return Error::NONE;
 }
 
-Error DrmComposerHal::setClientTarget(Display /*displayId*/,
+Error DrmComposerHal::setClientTarget(Display displayId,
         buffer_handle_t target, int32_t acquireFence,
         int32_t /*dataspace*/, const std::vector<hwc_rect_t>& /*damage*/) {
-    mBuffer = target;
-    mAcquireFence.reset(acquireFence);
+    base::unique_fd fence{acquireFence};
+
+    auto hwcDisplay = getHwcDisplay(displayId);
+    if (!hwcDisplay)
+        return Error::BAD_DISPLAY;
+
+    std::scoped_lock lock{hwcDisplay->mutex};
+    hwcDisplay->buffer = target;
+    hwcDisplay->acquireFence = std::move(fence);
     return Error::NONE;
 }
 
-Error DrmComposerHal::setOutputBuffer(Display /*displayId*/,
-        buffer_handle_t /*buffer*/, int32_t /*releaseFence*/) {
-    return Error::BAD_DISPLAY; // Virtual display
+Error DrmComposerHal::setOutputBuffer(Display displayId,
+        buffer_handle_t buffer, int32_t releaseFence) {
+    base::unique_fd fence{releaseFence};
+
+    auto hwcDisplay = getHwcDisplay(displayId);
+    if (!hwcDisplay || !hwcDisplay->isVirtual)
+        return Error::BAD_DISPLAY;
+
+    std::scoped_lock lock{hwcDisplay->mutex};
+    hwcDisplay->outputBuffer = buffer;
+    hwcDisplay->outputFence = std::move(fence);
+    return Error::NONE;
 }
 
 Error DrmComposerHal::validateDisplay(Display displayId, std::vector<Layer>* outChangedLayers,
         std::vector<IComposerClient::Composition>* outCompositionTypes,
         uint32_t* /*outDisplayRequestMask*/, std::vector<Layer>* /*outRequestedLayers*/,
         std::vector<uint32_t>* /*outRequestMasks*/) {
+    auto hwcDisplay = getHwcDisplay(displayId);
+    if (hwcDisplay && hwcDisplay->isVirtual) {
+        // All layers are composed by the client directly into the output buffer (ideally)
+        std::scoped_lock lock{hwcDisplay->mutex};
+        auto& layers = hwcDisplay->layers;
+        for (size_t i = 0; i < layers.size(); ++i) {
+            if (layers.composition[i] != IComposerClient::Composition::CLIENT) {
+                outChangedLayers->push_back(layers.ids[i]);
+                outCompositionTypes->push_back(IComposerClient::Composition::CLIENT);
+            }
+        }
+        hwcDisplay->validated = true;
+        return Error::NONE;
+    }
+
+    auto display = getConnectedDisplay(displayId);
+    if (!display || !hwcDisplay)
+        return Error::BAD_DISPLAY;
+
+    std::scoped_lock lock{hwcDisplay->mutex};
+    auto& layers = hwcDisplay->layers;
+
+    auto cursor = LayerTable::NONE;
+    for (size_t i = 0; i < layers.size(); ++i) {
+        if (layers.composition[i] == IComposerClient::Composition::CURSOR
+                && !hwcDisplay->clientColorTransform
+                && display->supportsCursor(layers.buffer[i])) {
+            cursor = i;
+            break;
+        }
+    }
+
+    /*
+     * A single fullscreen layer can be displayed directly, without copying
+     * it into the client target. This requires present fences, because
+     * they are also used as release fences for the layer.
+     */
+    auto scanout = LayerTable::NONE;
+    if (layers.size() - (cursor != LayerTable::NONE) == 1 && display->presentFences()
+            && !hwcDisplay->clientColorTransform) {
+        size_t i = cursor == 0 ? 1 : 0;
+        if (canScanout(*display, layers, i))
+            scanout = i;
+    }
 
-    for (auto& it : mLayers) {
-        auto layer = it.second;
-        if (layer.displayId == displayId
-                && layer.composition != IComposerClient::Composition::CLIENT) {
-            // Force client composition for all layers
-            outChangedLayers->push_back(it.first);
-            outCompositionTypes->push_back(IComposerClient::Composition::CLIENT);
+    /*
+     * Otherwise, the layers can be composed using the CPU (e.g. if there is
+     * no working GPU), but only if all of them are supported. Mixing software
+     * and client composition would need another copy of the client target.
+     */
+    auto software = mCpuComposition && scanout == LayerTable::NONE
+        && !hwcDisplay->clientColorTransform;
+    for (size_t i = 0; software && i < layers.size(); ++i) {
+        if (i != cursor && !SoftwareCompositor::supports(layers, i))
+            software = false;
+    }
+
+    // Force client composition for all other layers
+    for (size_t i = 0; i < layers.size(); ++i) {
+        auto composition = IComposerClient::Composition::CLIENT;
+        if (i == cursor)
+            composition = IComposerClient::Composition::CURSOR;
+        else if (i == scanout)
+            composition = IComposerClient::Composition::DEVICE;
+        else if (software)
+            composition = layers.composition[i]; // DEVICE or SOLID_COLOR
+
+        if (layers.composition[i] != composition) {
+            outChangedLayers->push_back(layers.ids[i]);
+            outCompositionTypes->push_back(composition);
         }
     }
 
+    hwcDisplay->scanout.reset();
+    if (scanout != LayerTable::NONE)
+        hwcDisplay->scanout = layers.ids[scanout];
+    hwcDisplay->software = software;
+    hwcDisplay->validated = true;
+
+    std::optional<Layer> cursorId;
+    if (cursor != LayerTable::NONE)
+        cursorId = layers.ids[cursor];
+    if (cursorId != hwcDisplay->cursor) {
+        // Upload the buffer of the new cursor layer on the next present
+        if (cursor != LayerTable::NONE)
+            layers.bufferChanged[cursor] = true;
+        hwcDisplay->cursor = cursorId;
+    }
+
     return Error::NONE;
 }
 
+bool DrmComposerHal::canScanout(const DrmDisplay& display, const LayerTable& layers, size_t i) {
+    // Premultiplied alpha blending onto the (black) background has no effect
+    if (layers.composition[i] != IComposerClient::Composition::DEVICE
+            || layers.transform[i] || layers.alpha[i] != 1.0f
+            || layers.blendMode[i] == HWC2_BLEND_MODE_COVERAGE)
+        return false;
+
+    auto width = display.width(display.currentMode());
+    auto height = display.height(display.currentMode());
+    auto& frame = layers.displayFrame[i];
+    auto& crop = layers.sourceCrop[i];
+    return frame.left == 0 && frame.top == 0
+        && frame.right == width && frame.bottom == height
+        && crop.left == 0.0f && crop.top == 0.0f
+        && crop.right == width && crop.bottom == height
+        && display.supportsScanout(layers.buffer[i]);
+}
+
 Error DrmComposerHal::acceptDisplayChanges(Display /*displayId*/) {
     return Error::NONE;
 }
 
-Error DrmComposerHal::presentDisplay(Display displayId, int32_t* /*outPresentFence*/,
-        std::vector<Layer>* /*outLayers*/, std::vector<int32_t>* /*outReleaseFences*/) {
-    auto display = mDevice->getConnectedDisplay(displayId);
-    if (!display)
+Error DrmComposerHal::presentDisplay(Display displayId, int32_t* outPresentFence,
+        std::vector<Layer>* outLayers, std::vector<int32_t>* outReleaseFences) {
+    auto hwcDisplay = getHwcDisplay(displayId);
+    if (hwcDisplay && hwcDisplay->isVirtual)
+        return presentVirtual(*hwcDisplay, outPresentFence);
+
+    auto display = getConnectedDisplay(displayId);
+    if (!display || !hwcDisplay)
         return Error::BAD_DISPLAY;
-    if (!mBuffer)
-        return Error::NO_RESOURCES;
 
-    if (mAcquireFence >= 0) {
-        sync_wait(mAcquireFence, -1);
-        mAcquireFence.reset();
+    std::scoped_lock lock{hwcDisplay->mutex};
+    auto& layers = hwcDisplay->layers;
+
+    // Also called without validateDisplay() first (presentOrValidate)
+    if (!hwcDisplay->validated)
+        return Error::NOT_VALIDATED;
+
+    // The layer might have been destroyed since validateDisplay()
+    auto scanout = hwcDisplay->scanout ? layers.find(*hwcDisplay->scanout) : LayerTable::NONE;
+    if (hwcDisplay->scanout && scanout == LayerTable::NONE)
+        return Error::NOT_VALIDATED;
+
+    // Before the frame, queueing it might wait until a previous frame was committed
+    base::unique_fd cursorFence;
+    auto cursor = hwcDisplay->cursor ? layers.find(*hwcDisplay->cursor) : LayerTable::NONE;
+    if (cursor != LayerTable::NONE) {
+        if (layers.bufferChanged[cursor]) {
+            // Copied on the commit thread, the release fence signals afterwards
+            display->setCursor(layers.buffer[cursor], std::move(layers.acquireFence[cursor]),
+                               &cursorFence);
+            layers.bufferChanged[cursor] = false;
+        }
+        display->moveCursor(layers.x[cursor], layers.y[cursor]);
+    } else {
+        display->hideCursor();
     }
 
-    display->present(mBuffer);
-    // TODO: Present/release fence
-    return Error::NONE;
-}
+    /*
+     * Without SKIP_CLIENT_COLOR_TRANSFORM, the client applies the color
+     * transform itself if it composes all layers, so the CRTC must not.
+     */
+    if (!mColorTransforms) {
+        auto bypass = !hwcDisplay->scanout && !hwcDisplay->software
+            && cursor == LayerTable::NONE;
+        display->bypassColorTransform(bypass);
+        if (mMirror) {
+            for (auto& mirror : getMirrors())
+                mirror->bypassColorTransform(bypass);
+        }
+    }
 
-Error DrmComposerHal::setLayerCursorPosition(Display /*displayId*/,
-        Layer /*layer*/, int32_t /*x*/, int32_t /*y*/) {
-    return Error::NONE; // Ignored
-}
+    // The frame is committed asynchronously once the acquire fence signals
+    base::unique_fd presentFence;
+    std::vector<Layer> composed; // Read by the software compositor
+    if (hwcDisplay->scanout) {
+        presentFence = present(*display,
+            display->device().framebuffers().get(layers.buffer[scanout]),
+            layers.buffer[scanout], std::move(layers.acquireFence[scanout]), true);
+    } else if (hwcDisplay->software) {
+        if (!hwcDisplay->compositor)
+            hwcDisplay->compositor = std::make_unique<SoftwareCompositor>(display->device());
+
+        std::vector<size_t> order;
+        for (size_t i = 0; i < layers.size(); ++i) {
+            if (layers.ids[i] != hwcDisplay->cursor)
+                order.push_back(i);
+        }
+        std::stable_sort(order.begin(), order.end(), [&layers] (size_t a, size_t b) {
+            return layers.z[a] < layers.z[b];
+        });
+
+        /*
+         * The layers are copied on the commit thread right before the frame
+         * is committed, so the present fence also releases them.
+         */
+        std::shared_ptr<SoftwareFrame> frame;
+        auto fb = hwcDisplay->compositor->compose(layers, order,
+            display->width(display->currentMode()), display->height(display->currentMode()),
+            &frame);
+        if (!fb)
+            return Error::NO_RESOURCES;
+
+        if (frame) {
+            for (auto i : order) {
+                if (layers.composition[i] == IComposerClient::Composition::DEVICE)
+                    composed.push_back(layers.ids[i]);
+            }
+        }
 
-Error DrmComposerHal::setLayerBuffer(Display /*displayId*/, Layer /*layer*/,
-        buffer_handle_t /*buffer*/, int32_t acquireFence) {
+        auto damaged = !!frame;
+        presentFence = present(*display, std::move(fb), nullptr, {}, damaged, std::move(frame));
+        hwcDisplay->compositor->presented(base::unique_fd{
+            presentFence >= 0 ? dup(presentFence) : -1});
+    } else {
+        if (!hwcDisplay->buffer)
+            return Error::NO_RESOURCES;
 
-    if (acquireFence >= 0) {
         /*
-         * This buffer will be only used by client composition.
-         * During client composition, SurfaceFlinger will wait for the buffer
-         * (if necessary), so there is no need to do it here.
+         * SurfaceFlinger passes the same client target again if nothing was
+         * composed, always with empty damage. The buffer that is displayed
+         * (or about to be) cannot be rendered to until it is released, so
+         * the commit thread skips the page flip if it is the same buffer.
          */
-        close(acquireFence);
+        presentFence = present(*display, display->device().framebuffers().get(hwcDisplay->buffer),
+            hwcDisplay->buffer, std::move(hwcDisplay->acquireFence), false);
     }
 
-    return Error::NONE; // Ignored
-}
+    /*
+     * The previous buffer of the layer is released once the new frame is
+     * displayed (and also the last one, if the layer is no longer displayed
+     * directly, once the client target replaces it).
+     */
+    auto release = [&] (Layer layer) {
+        outLayers->push_back(layer);
+        outReleaseFences->push_back(presentFence >= 0 ? dup(presentFence) : -1);
+    };
+    if (hwcDisplay->scanout)
+        release(*hwcDisplay->scanout);
+    for (auto layer : composed)
+        release(layer);
+    if (hwcDisplay->presentedScanout && hwcDisplay->presentedScanout != hwcDisplay->scanout
+            && std::find(composed.begin(), composed.end(), *hwcDisplay->presentedScanout)
+                == composed.end())
+        release(*hwcDisplay->presentedScanout);
+    hwcDisplay->presentedScanout = hwcDisplay->scanout;
+
+    if (cursorFence >= 0) {
+        // The cursor layer might also have been displayed directly until now
+        auto it = std::find(outLayers->begin(), outLayers->end(), *hwcDisplay->cursor);
+        if (it == outLayers->end()) {
+            outLayers->push_back(*hwcDisplay->cursor);
+            outReleaseFences->push_back(cursorFence.release());
+        } else {
+            auto& fence = (*outReleaseFences)[it - outLayers->begin()];
+            base::unique_fd previous{fence};
+            fence = previous >= 0 ? sync_merge("drmfb-cursor", previous, cursorFence)
+                                  : cursorFence.release();
+        }
+    }
 
-Error DrmComposerHal::setLayerSurfaceDamage(Display /*displayId*/,
-        Layer /*layer*/, const std::vector<hwc_rect_t>& /*damage*/) {
-    return Error::NONE; // Ignored
+    *outPresentFence = presentFence.release();
+    return Error::NONE;
 }
 
-Error DrmComposerHal::setLayerBlendMode(Display /*displayId*/,
-        Layer /*layer*/, int32_t /*mode*/) {
-    return Error::NONE; // Ignored
-}
+Error DrmComposerHal::presentVirtual(HwcDisplay& hwcDisplay, int32_t* outPresentFence) {
+    std::scoped_lock lock{hwcDisplay.mutex};
+    if (!hwcDisplay.validated)
+        return Error::NOT_VALIDATED;
+    if (!hwcDisplay.buffer || !hwcDisplay.outputBuffer)
+        return Error::NO_RESOURCES;
 
-Error DrmComposerHal::setLayerColor(Display /*displayId*/,
-        Layer /*layer*/, IComposerClient::Color /*color*/) {
-    return Error::NONE; // Ignored
+    /*
+     * If only client composition is used, SurfaceFlinger renders directly
+     * into the output buffer, so it is passed as client target as well.
+     * The frame is complete once the client target has been rendered.
+     */
+    if (hwcDisplay.buffer == hwcDisplay.outputBuffer || (!mDevices.empty()
+            && sameBuffer(mDevices.front()->gemHandles(), hwcDisplay.buffer,
+                          hwcDisplay.outputBuffer))) {
+        hwcDisplay.outputFence.reset();
+        *outPresentFence = hwcDisplay.acquireFence.release();
+        return Error::NONE;
+    }
+
+    // Otherwise, copy the client target (on the copy thread, the present fence signals after)
+    base::unique_fd presentFence;
+    if (!hwcDisplay.copyThread->queue(hwcDisplay.buffer, std::move(hwcDisplay.acquireFence),
+            hwcDisplay.outputBuffer, std::move(hwcDisplay.outputFence), &presentFence))
+        return Error::NO_RESOURCES;
+
+    *outPresentFence = presentFence.release();
+    return Error::NONE;
 }
 
-Error DrmComposerHal::setLayerCompositionType(Display displayId, Layer layer, int32_t type) {
-    auto i = mLayers.find(layer);
-    if (i == mLayers.end())
+Error DrmComposerHal::setLayerCursorPosition(Display displayId,
+        Layer layer, int32_t x, int32_t y) {
+    auto display = getConnectedDisplay(displayId);
+    auto hwcDisplay = getHwcDisplay(displayId);
+    if (!hwcDisplay || (!display && !hwcDisplay->isVirtual))
+        return Error::BAD_DISPLAY;
+
+    std::scoped_lock lock{hwcDisplay->mutex};
+    auto& layers = hwcDisplay->layers;
+    auto i = layers.find(layer);
+    if (i == LayerTable::NONE)
         return Error::BAD_LAYER;
-    if (displayId != i->second.displayId)
+
+    layers.x[i] = x;
+    layers.y[i] = y;
+
+    // Move the cursor immediately, without waiting for the next present
+    if (display && hwcDisplay->cursor == layer)
+        display->moveCursor(x, y);
+    return Error::NONE;
+}
+
+Error DrmComposerHal::setLayerBuffer(Display displayId, Layer layer,
+        buffer_handle_t buffer, int32_t acquireFence) {
+    /*
+     * The buffer is only used directly for the cursor layer, direct scanout
+     * and software composition. During client composition, SurfaceFlinger
+     * will wait for the buffer (if necessary), so the fence is not needed
+     * in that case.
+     */
+    base::unique_fd fence{acquireFence};
+
+    auto display = getConnectedDisplay(displayId);
+    auto hwcDisplay = getHwcDisplay(displayId);
+    if (!hwcDisplay || (!display && !hwcDisplay->isVirtual))
         return Error::BAD_DISPLAY;
 
-    i->second.composition = static_cast<IComposerClient::Composition>(type);
+    std::scoped_lock lock{hwcDisplay->mutex};
+    auto& layers = hwcDisplay->layers;
+    auto i = layers.find(layer);
+    if (i == LayerTable::NONE)
+        return Error::BAD_LAYER;
+
+    layers.buffer[i] = buffer;
+    layers.acquireFence[i] = std::move(fence);
+    layers.bufferChanged[i] = true;
+    if (!display)
+        return Error::NONE; // Virtual displays only use client composition
+
+    /*
+     * New buffers for client composition do not change the result of the
+     * validation. Only the layers displayed directly need to be checked again
+     * (e.g. if the size or format of the buffer has changed).
+     */
+    if ((hwcDisplay->cursor == layer && !display->supportsCursor(buffer))
+            || (hwcDisplay->scanout == layer && !canScanout(*display, layers, i))
+            || (hwcDisplay->software && hwcDisplay->cursor != layer
+                && !SoftwareCompositor::supports(layers, i)))
+        hwcDisplay->validated = false;
     return Error::NONE;
 }
 
+Error DrmComposerHal::setLayerSurfaceDamage(Display displayId,
+        Layer layer, const std::vector<hwc_rect_t>& damage) {
+    return updateLayer(displayId, layer, [&damage] (LayerTable& l, size_t i) {
+        l.damage[i] = damage;
+        return false;
+    });
+}
+
+Error DrmComposerHal::setLayerBlendMode(Display displayId, Layer layer, int32_t mode) {
+    return updateLayer(displayId, layer, [mode] (LayerTable& l, size_t i) {
+        return change(&l.blendMode[i], mode);
+    });
+}
+
+Error DrmComposerHal::setLayerColor(Display displayId,
+        Layer layer, IComposerClient::Color color) {
+    // Only used for software composition, which supports all colors
+    return updateLayer(displayId, layer, [&color] (LayerTable& l, size_t i) {
+        l.color[i] = color;
+        return false;
+    });
+}
+
+Error DrmComposerHal::setLayerCompositionType(Display displayId, Layer layer, int32_t type) {
+    return updateLayer(displayId, layer, [type] (LayerTable& l, size_t i) {
+        return change(&l.composition[i], static_cast<IComposerClient::Composition>(type));
+    });
+}
+
 Error DrmComposerHal::setLayerDataspace(Display /*displayId*/,
         Layer /*layer*/, int32_t /*dataspace*/) {
     return Error::NONE; // Ignored
 }
 
-Error DrmComposerHal::setLayerDisplayFrame(Display /*displayId*/,
-        Layer /*layer*/, const hwc_rect_t& /*frame*/) {
-    return Error::NONE; // Ignored
+Error DrmComposerHal::setLayerDisplayFrame(Display displayId,
+        Layer layer, const hwc_rect_t& frame) {
+    return updateLayer(displayId, layer, [&frame] (LayerTable& l, size_t i) {
+        l.x[i] = frame.left;
+        l.y[i] = frame.top;
+
+        // The cursor can be moved without validating again
+        return change(&l.displayFrame[i], frame)
+            && l.composition[i] != IComposerClient::Composition::CURSOR;
+    });
 }
 
-Error DrmComposerHal::setLayerPlaneAlpha(Display /*displayId*/,
-        Layer /*layer*/, float /*alpha*/) {
-    return Error::NONE; // Ignored
+Error DrmComposerHal::setLayerPlaneAlpha(Display displayId, Layer layer, float alpha) {
+    return updateLayer(displayId, layer, [alpha] (LayerTable& l, size_t i) {
+        return change(&l.alpha[i], alpha);
+    });
 }
 
 Error DrmComposerHal::setLayerSidebandStream(Display /*displayId*/,
@@ -382,14 +1058,17 @@ Error DrmComposerHal::setLayerSidebandStream(Display /*displayId*/,
     return Error::NONE; // Ignored
 }
 
-Error DrmComposerHal::setLayerSourceCrop(Display /*displayId*/,
-        Layer /*layer*/, const hwc_frect_t& /*crop*/) {
-    return Error::NONE; // Ignored
+Error DrmComposerHal::setLayerSourceCrop(Display displayId,
+        Layer layer, const hwc_frect_t& crop) {
+    return updateLayer(displayId, layer, [&crop] (LayerTable& l, size_t i) {
+        return change(&l.sourceCrop[i], crop);
+    });
 }
 
-Error DrmComposerHal::setLayerTransform(Display /*displayId*/,
-        Layer /*layer*/, int32_t /*transform*/) {
-    return Error::NONE; // Ignored
+Error DrmComposerHal::setLayerTransform(Display displayId, Layer layer, int32_t transform) {
+    return updateLayer(displayId, layer, [transform] (LayerTable& l, size_t i) {
+        return change(&l.transform[i], transform);
+    });
 }
 
 Error DrmComposerHal::setLayerVisibleRegion(Display /*displayId*/,
@@ -397,9 +1076,12 @@ Error DrmComposerHal::setLayerVisibleRegion(Display /*displayId*/,
     return Error::NONE; // Ignored
 }
 
-Error DrmComposerHal::setLayerZOrder(Display /*displayId*/,
-        Layer /*layer*/, uint32_t /*z*/) {
-    return Error::NONE; // Ignored
+Error DrmComposerHal::setLayerZOrder(Display displayId, Layer layer, uint32_t z) {
+    // Software composition sorts the layers when presenting, so this is always supported
+    return updateLayer(displayId, layer, [z] (LayerTable& l, size_t i) {
+        l.z[i] = z;
+        return false;
+    });
 }
 
 }  // namespace drmfb
@@ -3,10 +3,17 @@
 
 #pragma once
 
+#include <memory>
+#include <mutex>
+#include <optional>
 #include <unordered_map>
+#include <vector>
 #include <android-base/unique_fd.h>
 #include <composer-hal/2.1/ComposerHal.h>
 #include "DrmDevice.h"
+#include "LayerTable.h"
+#include "SoftwareCompositor.h"
+#include "VirtualDisplayThread.h"
 
 namespace android {
 namespace hardware {
@@ -21,7 +28,7 @@ using hal::PixelFormat;
 using hal::Hdr;
 
 struct DrmComposerHal : public hal::ComposerHal, DrmCallback {
-    DrmComposerHal(std::unique_ptr<DrmDevice> device);
+    DrmComposerHal(std::vector<std::unique_ptr<DrmDevice>> devices);
 
     bool hasCapability(hwc2_capability_t capability) override;
     std::string dumpDebugInfo() override;
@@ -92,21 +99,75 @@ struct DrmComposerHal : public hal::ComposerHal, DrmCallback {
     Error setLayerZOrder(Display display, Layer layer, uint32_t z) override;
 
 private:
-    struct HwcLayer {
-        HwcLayer(Display displayId) : displayId(displayId) {}
-        const Display displayId;
-        IComposerClient::Composition composition = IComposerClient::Composition::INVALID;
+    // The composition state of a single display
+    struct HwcDisplay {
+        std::mutex mutex; // Protects the state below
+        LayerTable layers;
+        std::optional<Layer> cursor; // Displayed using the cursor plane
+        std::optional<Layer> scanout; // Displayed directly instead of the client target
+        std::optional<Layer> presentedScanout; // Needs a release fence on the next present
+        bool software = false; // All other layers are composed using the CPU
+        bool clientColorTransform = false; // Not supported by the hardware
+        std::unique_ptr<SoftwareCompositor> compositor; // Created on first use
+
+        // Reset on changes that might change the result of validateDisplay()
+        bool validated = false;
+
+        // The next client target buffer to be displayed
+        buffer_handle_t buffer = nullptr;
+        base::unique_fd acquireFence;
+
+        // Virtual displays have no DrmDisplay, the client target is copied
+        bool isVirtual = false;
+        uint32_t width = 0, height = 0;
+        buffer_handle_t outputBuffer = nullptr;
+        base::unique_fd outputFence; // Must signal before writing to the output buffer
+        std::unique_ptr<VirtualDisplayThread> copyThread;
     };
 
-    std::unique_ptr<DrmDevice> mDevice; // TODO: Support multiple GPUs?
+    std::shared_ptr<DrmDisplay> getConnectedDisplay(Display displayId);
+    std::shared_ptr<HwcDisplay> getHwcDisplay(Display displayId);
+    // Mirrors that were not enabled yet are set up for the mode of the source, if set
+    std::vector<std::shared_ptr<DrmDisplay>> getMirrors(const DrmDisplay* source = nullptr);
+    base::unique_fd present(DrmDisplay& display, std::shared_ptr<const DrmFramebuffer> fb,
+                            buffer_handle_t buffer, base::unique_fd acquireFence, bool damaged,
+                            std::shared_ptr<SoftwareFrame> frame = nullptr);
+    static bool canScanout(const DrmDisplay& display, const LayerTable& layers, size_t i);
+    bool hasDisplay(Display displayId);
+    Error presentVirtual(HwcDisplay& hwcDisplay, int32_t* outPresentFence);
+
+    // Calls update() with the index of the layer (with the lock of the display held),
+    // it returns true if the display needs to be validated again
+    template<typename F>
+    Error updateLayer(Display displayId, Layer layer, F update);
+
+    // Display IDs contain the index of the device (e.g. for a second GPU)
+    std::vector<std::unique_ptr<DrmDevice>> mDevices;
     EventCallback *mCallback = nullptr;
-
-    std::unordered_map<Layer, HwcLayer> mLayers;
-    Layer mNextLayer = 0;
-
-    // The next client target buffer to be displayed
-    buffer_handle_t mBuffer = nullptr;
-    base::unique_fd mAcquireFence;
+    bool mCpuComposition;
+    bool mMirror;
+    uint32_t mMaxVirtualDisplays;
+    bool mColorTransforms; // Applied by all CRTCs (SKIP_CLIENT_COLOR_TRANSFORM)
+    bool mDiagonalColorTransforms; // Only matrices that do not mix the channels
+
+    /*
+     * Only protects the map itself, the state of each display is protected
+     * by its own lock so that displays can be presented concurrently.
+     */
+    std::mutex mDisplaysMutex;
+    std::unordered_map<Display, std::shared_ptr<HwcDisplay>> mDisplays;
+    uint32_t mVirtualDisplays = 0;
+    Display mNextVirtualDisplay = 0;
+
+    /*
+     * With hwc.drm.mirror, only the first display is reported. All other
+     * displays show its frames (without composing them again).
+     */
+    struct Mirror {
+        Display id;
+        bool enabled = false; // Since the first display was turned on (or changed its mode)
+    };
+    std::vector<Mirror> mMirrors; // Protected by mDisplaysMutex
 };
 
 }  // namespace drmfb
@@ -0,0 +1,150 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (C) 2019 Stephan Gerhold
+
+#define LOG_TAG "drmfb-cursor"
+
+#include <cstring>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/dma-buf.h>
+#include <android-base/logging.h>
+#include <drm/drm_fourcc.h>
+#include <xf86drm.h>
+#include "DrmCursor.h"
+#include "DrmDevice.h"
+#include "DrmFramebuffer.h"
+
+namespace android {
+namespace hardware {
+namespace graphics {
+namespace composer {
+namespace V2_1 {
+namespace drmfb {
+
+namespace {
+constexpr uint64_t DEFAULT_CURSOR_SIZE = 64;
+constexpr uint32_t OPAQUE = 0xff000000;
+
+uint64_t getCap(int fd, uint64_t cap, uint64_t fallback) {
+    uint64_t value;
+    return drmGetCap(fd, cap, &value) || !value ? fallback : value;
+}
+
+bool supportsFormat(uint32_t format) {
+    switch (format) {
+    case DRM_FORMAT_ARGB8888:
+    case DRM_FORMAT_XRGB8888:
+    case DRM_FORMAT_ABGR8888:
+    case DRM_FORMAT_XBGR8888:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Convert a pixel to ARGB8888 (the format of the cursor)
+inline uint32_t convertPixel(uint32_t format, uint32_t p) {
+    switch (format) {
+    case DRM_FORMAT_XRGB8888:
+        return p | OPAQUE;
+    case DRM_FORMAT_ABGR8888:
+        return (p & 0xff00ff00) | ((p >> 16) & 0xff) | ((p & 0xff) << 16);
+    case DRM_FORMAT_XBGR8888:
+        return (p & 0x0000ff00) | ((p >> 16) & 0xff) | ((p & 0xff) << 16) | OPAQUE;
+    default:
+        return p;
+    }
+}
+
+void syncBuffer(int fd, uint64_t flags) {
+    // Not supported by older kernels, but still worth trying
+    dma_buf_sync sync{ .flags = flags | DMA_BUF_SYNC_READ };
+    ioctl(fd, DMA_BUF_IOCTL_SYNC, &sync);
+}
+}
+
+DrmCursor::DrmCursor(DrmDevice& device)
+    : mDevice(device),
+      mWidth(getCap(device.fd(), DRM_CAP_CURSOR_WIDTH, DEFAULT_CURSOR_SIZE)),
+      mHeight(getCap(device.fd(), DRM_CAP_CURSOR_HEIGHT, DEFAULT_CURSOR_SIZE)) {}
+
+DrmCursor::~DrmCursor() {
+    if (mMap)
+        munmap(mMap, mSize);
+    if (mHandle) {
+        drm_mode_destroy_dumb destroy{ .handle = mHandle };
+        drmIoctl(mDevice.fd(), DRM_IOCTL_MODE_DESTROY_DUMB, &destroy);
+    }
+}
+
+bool DrmCursor::supports(buffer_handle_t buffer) const {
+    BufferInfo info;
+    return buffer && getBufferInfo(buffer, &info)
+        && info.width <= mWidth && info.height <= mHeight
+        && supportsFormat(info.format);
+}
+
+bool DrmCursor::allocate() {
+    if (mHandle)
+        return mMap != nullptr; // Already allocated (or failed to map)
+
+    drm_mode_create_dumb create{ .height = mHeight, .width = mWidth, .bpp = 32 };
+    if (drmIoctl(mDevice.fd(), DRM_IOCTL_MODE_CREATE_DUMB, &create)) {
+        PLOG(ERROR) << "Failed to create cursor buffer";
+        return false;
+    }
+    mHandle = create.handle;
+    mPitch = create.pitch;
+    mSize = create.size;
+
+    drm_mode_map_dumb map{ .handle = mHandle };
+    if (drmIoctl(mDevice.fd(), DRM_IOCTL_MODE_MAP_DUMB, &map)) {
+        PLOG(ERROR) << "Failed to map cursor buffer";
+        return false;
+    }
+
+    auto addr = mmap(nullptr, mSize, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     mDevice.fd(), map.offset);
+    if (addr == MAP_FAILED) {
+        PLOG(ERROR) << "Failed to mmap cursor buffer";
+        return false;
+    }
+
+    mMap = static_cast<uint8_t*>(addr);
+    return true;
+}
+
+bool DrmCursor::update(const BufferInfo& info) {
+    if (!allocate())
+        return false;
+
+    size_t size = info.offset + info.stride * info.height;
+    auto addr = mmap(nullptr, size, PROT_READ, MAP_SHARED, info.fd, 0);
+    if (addr == MAP_FAILED) {
+        PLOG(ERROR) << "Failed to mmap cursor layer buffer";
+        return false;
+    }
+
+    // Clear everything outside of the buffer (the cursor might be larger)
+    memset(mMap, 0, mSize);
+
+    syncBuffer(info.fd, DMA_BUF_SYNC_START);
+    auto src = static_cast<const uint8_t*>(addr) + info.offset;
+    for (uint32_t y = 0; y < info.height; ++y) {
+        auto srcRow = reinterpret_cast<const uint32_t*>(src + y * info.stride);
+        auto dstRow = reinterpret_cast<uint32_t*>(mMap + y * mPitch);
+        for (uint32_t x = 0; x < info.width; ++x)
+            dstRow[x] = convertPixel(info.format, srcRow[x]);
+    }
+    syncBuffer(info.fd, DMA_BUF_SYNC_END);
+
+    munmap(addr, size);
+    return true;
+}
+
+}  // namespace drmfb
+}  // namespace V2_1
+}  // namespace composer
+}  // namespace graphics
+}  // namespace hardware
+}  // namespace android
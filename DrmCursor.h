@@ -0,0 +1,54 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (C) 2019 Stephan Gerhold
+
+#pragma once
+
+#include <cstdint>
+#include <cutils/native_handle.h>
+#include "DrmFramebufferImporter.h"
+
+namespace android {
+namespace hardware {
+namespace graphics {
+namespace composer {
+namespace V2_1 {
+namespace drmfb {
+
+struct DrmDevice;
+
+/*
+ * A cursor buffer object (dumb buffer) for the legacy cursor ioctls.
+ * The contents of cursor layers are copied into it using the CPU,
+ * because cursor planes usually require a specific size and format (ARGB8888).
+ */
+struct DrmCursor {
+    DrmCursor(DrmDevice& device);
+    ~DrmCursor();
+
+    inline uint32_t handle() const { return mHandle; }
+    inline uint32_t width() const { return mWidth; }
+    inline uint32_t height() const { return mHeight; }
+
+    // Whether the buffer can be displayed using the cursor
+    bool supports(buffer_handle_t buffer) const;
+    // Copy the contents of the buffer (it must be ready for reading)
+    bool update(const BufferInfo& info);
+
+private:
+    bool allocate();
+
+    DrmDevice& mDevice;
+    uint32_t mWidth, mHeight;
+
+    uint32_t mHandle = 0;
+    uint32_t mPitch = 0;
+    uint64_t mSize = 0;
+    uint8_t* mMap = nullptr;
+};
+
+}  // namespace drmfb
+}  // namespace V2_1
+}  // namespace composer
+}  // namespace graphics
+}  // namespace hardware
+}  // namespace android
@@ -3,11 +3,16 @@
 
 #define LOG_TAG "drmfb-device"
 
+#include <algorithm>
+#include <climits>
+#include <cstring>
 #include <fcntl.h>
+#include <sys/prctl.h>
 #include <android-base/logging.h>
-#include <android-base/properties.h>
+#include <xf86drm.h>
 #include "drm_unique_ptr.h"
 #include "DrmDevice.h"
+#include "ThreadScheduling.h"
 
 namespace android {
 namespace hardware {
@@ -16,39 +21,248 @@ namespace composer {
 namespace V2_1 {
 namespace drmfb {
 
-DrmDevice::DrmDevice(int fd) : mFd(fd), mHotplugThread(*this) {}
-DrmDevice::DrmDevice(const std::string& path) : DrmDevice(open(path.c_str(), O_RDWR)) {
+DrmDevice::DrmDevice(int fd, unsigned index)
+    : mFd(fd), mIndex(index), mGemHandles(*this), mFramebuffers(*this),
+      mHotplugThread(*this), mEventThread(*this) {}
+DrmDevice::DrmDevice(const std::string& path, unsigned index)
+    : DrmDevice(open(path.c_str(), O_RDWR | O_CLOEXEC), index) {
     if (mFd < 0)
         PLOG(ERROR) << "Failed to open DRM device (" << path << ")";
 }
-DrmDevice::DrmDevice()
-    : DrmDevice(base::GetProperty("hwc.drm.device", "/dev/dri/card0")) {}
 
-DrmDisplay* DrmDevice::getConnectedDisplay(uint32_t connector) {
+DrmDevice::~DrmDevice() {
+    {
+        std::scoped_lock lock{mProbeMutex};
+        mProbeStopped = true; // Only wait for the probes that have already started
+    }
+    if (mProbeThread.joinable())
+        mProbeThread.join();
+
+    mHotplugThread.stop();
+
+    // Destroy the displays while the event thread still exists (for their timers)
+    decltype(mDisplays) displays;
+    {
+        std::scoped_lock lock{mDisplaysMutex};
+        displays.swap(mDisplays);
+    }
+}
+
+std::shared_ptr<DrmDisplay> DrmDevice::getDisplay(uint32_t connector) {
+    std::scoped_lock lock{mDisplaysMutex};
     auto i = mDisplays.find(connector);
-    if (i == mDisplays.end()) {
-        return nullptr;
+    return i != mDisplays.end() ? i->second : nullptr;
+}
+
+std::shared_ptr<DrmDisplay> DrmDevice::getConnectedDisplay(uint32_t connector) {
+    auto display = getDisplay(connector);
+    return display && display->connected() ? display : nullptr;
+}
+
+std::shared_ptr<DrmDisplay> DrmDevice::getEventDisplay(uint32_t token) {
+    std::scoped_lock lock{mDisplaysMutex};
+    for (const auto& p : mDisplays) {
+        if (p.second->eventToken() == token)
+            return p.second;
     }
+    return nullptr;
+}
+
+std::vector<std::shared_ptr<DrmDisplay>> DrmDevice::displays() {
+    std::scoped_lock lock{mDisplaysMutex};
+    std::vector<std::shared_ptr<DrmDisplay>> displays;
+    displays.reserve(mDisplays.size());
+    for (const auto& p : mDisplays)
+        displays.push_back(p.second);
+    return displays;
+}
 
-    auto display = i->second.get();
-    return display->connected() ? display : nullptr;
+bool DrmDevice::presentFences() const {
+    std::scoped_lock lock{mDisplaysMutex};
+    return std::all_of(mDisplays.begin(), mDisplays.end(),
+        [] (const auto& pair) { return pair.second->presentFences(); });
 }
 
-uint32_t DrmDevice::reserveCrtc(unsigned pipe) {
-    auto mask = 1 << pipe;
-    if (pipe < mCrtcs.size() && !(mUsedCrtcs & mask)) {
-        mUsedCrtcs |= mask;
-        return mCrtcs[pipe];
+bool DrmDevice::findCrtc(uint32_t connector, uint32_t possibleCrtcs, bool preferPlanes,
+        uint32_t preferredCrtc, std::vector<Move>* moves) {
+    auto possible = [&] (uint32_t mask, size_t pipe) {
+        // possible_crtcs is a 32-bit mask, like in the kernel
+        return pipe < 32 && (mask & (1u << pipe));
+    };
+    auto score = [&] (size_t pipe) {
+        // Keep the CRTC that already displays the mode, it avoids a mode set
+        if (mCrtcs[pipe].id == preferredCrtc)
+            return INT_MAX;
+
+        // Leave CRTCs with more planes to the displays that need them
+        int planes = mCrtcs[pipe].cursor * 16 + mCrtcs[pipe].overlays;
+        return preferPlanes ? planes : -planes;
+    };
+
+    // Prefer a free CRTC, no other displays need to be moved then
+    auto best = mCrtcs.size();
+    for (size_t pipe = 0; pipe < mCrtcs.size(); ++pipe) {
+        if (!mCrtcs[pipe].owner && possible(possibleCrtcs, pipe)
+                && (best == mCrtcs.size() || score(pipe) > score(best)))
+            best = pipe;
     }
-    return 0;
+    if (best < mCrtcs.size()) {
+        moves->push_back({connector, static_cast<unsigned>(best), possibleCrtcs});
+        return true;
+    }
+
+    /*
+     * Search for the shortest augmenting path (breadth-first): a chain of
+     * displays that can each move to the CRTC of the next one, ending with
+     * a free CRTC. This moves as few displays as possible.
+     */
+    constexpr auto NONE = SIZE_MAX;
+    std::vector<size_t> parent(mCrtcs.size(), NONE);
+    std::vector<bool> visited(mCrtcs.size());
+    std::deque<size_t> queue;
+    for (size_t pipe = 0; pipe < mCrtcs.size(); ++pipe) {
+        if (possible(possibleCrtcs, pipe)) {
+            visited[pipe] = true;
+            queue.push_back(pipe);
+        }
+    }
+
+    while (!queue.empty()) {
+        auto pipe = queue.front();
+        queue.pop_front();
+
+        const auto& crtc = mCrtcs[pipe];
+        for (size_t next = 0; next < mCrtcs.size(); ++next) {
+            if (visited[next] || !possible(crtc.ownerCrtcs, next))
+                continue;
+            visited[next] = true;
+            parent[next] = pipe;
+
+            if (mCrtcs[next].owner) {
+                queue.push_back(next);
+                continue;
+            }
+
+            // Move each display on the path to the next CRTC, starting at the end
+            auto to = next;
+            for (; parent[to] != NONE; to = parent[to]) {
+                const auto& from = mCrtcs[parent[to]];
+                moves->push_back({from.owner, static_cast<unsigned>(to), from.ownerCrtcs});
+            }
+            moves->push_back({connector, static_cast<unsigned>(to), possibleCrtcs});
+            return true;
+        }
+    }
+    return false;
 }
 
-void DrmDevice::freeCrtc(unsigned pipe) {
-    if (pipe < mCrtcs.size()) {
-        mUsedCrtcs &= ~(1 << pipe);
+bool DrmDevice::assignCrtc(DrmDisplay& display, uint32_t possibleCrtcs) {
+    std::scoped_lock assignLock{mAssignMutex};
+    if (display.hasCrtc()) // Takes the lock of the display
+        return true;
+
+    std::vector<Move> moves;
+    auto preferPlanes = display.needsPlanes();
+    auto preferredCrtc = display.preferredCrtc();
+    {
+        std::scoped_lock lock{mCrtcMutex};
+        if (!findCrtc(display.connector(), possibleCrtcs, preferPlanes, preferredCrtc, &moves)) {
+            LOG(ERROR) << "Failed to find CRTC for display " << display;
+            return false;
+        }
+
+        for (auto& move : moves) {
+            mCrtcs[move.pipe].owner = move.connector;
+            mCrtcs[move.pipe].ownerCrtcs = move.possibleCrtcs;
+        }
+    }
+
+    // The displays are moved in order, so each CRTC is free before it is used again
+    for (auto& move : moves) {
+        auto crtc = mCrtcs[move.pipe].id;
+        if (move.connector == display.connector()) {
+            display.setCrtc(move.pipe, crtc, false);
+        } else if (auto other = getDisplay(move.connector)) {
+            other->setCrtc(move.pipe, crtc, true);
+        } else {
+            freeCrtc(move.pipe, move.connector); // Removed in the meantime
+        }
+    }
+    return true;
+}
+
+void DrmDevice::freeCrtc(unsigned pipe, uint32_t connector) {
+    std::scoped_lock lock{mCrtcMutex};
+    // The CRTC might have been given to another display in the meantime
+    if (pipe < mCrtcs.size() && mCrtcs[pipe].owner == connector) {
+        mCrtcs[pipe].owner = 0;
+        mCrtcs[pipe].ownerCrtcs = 0;
+    }
+}
+
+void DrmDevice::probePlanes() {
+    // Cursor and primary planes are only listed with universal planes
+    if (drmSetClientCap(mFd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1))
+        return; // Not supported, no planes worth looking at
+
+    drm::mode::unique_plane_res_ptr res{drmModeGetPlaneResources(mFd)};
+    for (uint32_t i = 0; res && i < res->count_planes; ++i) {
+        drm::mode::unique_plane_ptr plane{drmModeGetPlane(mFd, res->planes[i])};
+        drm::mode::unique_object_properties_ptr props{
+            drmModeObjectGetProperties(mFd, res->planes[i], DRM_MODE_OBJECT_PLANE)};
+        if (!plane || !props)
+            continue;
+
+        uint64_t type = DRM_PLANE_TYPE_OVERLAY;
+        for (uint32_t j = 0; j < props->count_props; ++j) {
+            drm::mode::unique_property_ptr property{drmModeGetProperty(mFd, props->props[j])};
+            if (property && !strcmp(property->name, "type"))
+                type = props->prop_values[j];
+        }
+
+        auto reserved = false;
+        for (size_t pipe = 0; pipe < mCrtcs.size() && pipe < 32; ++pipe) {
+            if (!(plane->possible_crtcs & (1u << pipe)))
+                continue;
+            if (type == DRM_PLANE_TYPE_CURSOR) {
+                mCrtcs[pipe].cursor = true;
+            } else if (type == DRM_PLANE_TYPE_OVERLAY) {
+                ++mCrtcs[pipe].overlays;
+
+                // Each plane is reserved for one CRTC, so CRTCs never compete for it
+                if (!reserved && !mCrtcs[pipe].overlay) {
+                    mCrtcs[pipe].overlay = plane->plane_id;
+                    reserved = true;
+                }
+            }
+        }
+    }
+
+    // Only the legacy API is used otherwise
+    drmSetClientCap(mFd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 0);
+}
+
+void DrmDevice::probeColor() {
+    for (auto& crtc : mCrtcs) {
+        drm::mode::unique_crtc_ptr info{drmModeGetCrtc(mFd, crtc.id)};
+        if (info)
+            crtc.gammaSize = info->gamma_size;
+
+        drm::mode::unique_object_properties_ptr props{
+            drmModeObjectGetProperties(mFd, crtc.id, DRM_MODE_OBJECT_CRTC)};
+        for (uint32_t i = 0; props && i < props->count_props; ++i) {
+            drm::mode::unique_property_ptr property{drmModeGetProperty(mFd, props->props[i])};
+            if (property && !strcmp(property->name, "CTM"))
+                crtc.ctm = property->prop_id;
+        }
     }
 }
 
+bool DrmDevice::colorTransforms(bool diagonal) const {
+    return !mCrtcs.empty() && std::all_of(mCrtcs.begin(), mCrtcs.end(),
+        [diagonal] (const auto& crtc) { return crtc.gammaSize && (diagonal || crtc.ctm); });
+}
+
 bool DrmDevice::initialize() {
     if (mFd < 0)
         return false;
@@ -59,61 +273,223 @@ bool DrmDevice::initialize() {
         return false;
     }
 
-    // Store the available CRTCs
-    mCrtcs.assign(res->crtcs, res->crtcs + res->count_crtcs);
+    // Store the available CRTCs (and their planes, to assign them to displays)
+    for (auto i = 0; i < res->count_crtcs; ++i)
+        mCrtcs.push_back({res->crtcs[i]});
+    probePlanes();
+    probeColor();
+
+    // Create displays for each connector, they are probed in the background
+    probe(updateConnectors(*res));
+
+    // Start handling page flip, vblank and hotplug events
+    mEventThread.enable();
+
+    // The primary display must be known before the HAL is registered
+    std::unique_lock lock{mProbeMutex};
+    mProbeCondition.wait(lock, [this] { return primaryProbed(); });
+    return true;
+}
+
+void DrmDevice::probe(std::vector<std::shared_ptr<DrmDisplay>> displays) {
+    // Internal displays are preferred as primary display, so probe them first
+    std::stable_partition(displays.begin(), displays.end(), [this] (const auto& display) {
+        drm::mode::unique_connector_ptr connector{
+            drmModeGetConnectorCurrent(mFd, display->connector())};
+        return connector && DrmDisplay::internal(connector->connector_type);
+    });
+
+    if (displays.empty())
+        return;
+
+    std::scoped_lock lock{mProbeMutex};
+    for (const auto& display : displays)
+        mProbing.insert(display->connector());
+    mProbeOrder = displays;
+    mProbeThread = std::thread{&DrmDevice::probeThread, this, std::move(displays)};
+}
+
+void DrmDevice::probeThread(std::vector<std::shared_ptr<DrmDisplay>> displays) {
+    prctl(PR_SET_NAME, "drm-probe", 0, 0, 0);
+    ThreadScheduling::get(ThreadClass::HOTPLUG).apply();
+
+    for (auto& display : displays) {
+        {
+            std::scoped_lock lock{mProbeMutex};
+            if (mProbeStopped)
+                return;
+        }
+
+        display->update(true);
+        {
+            std::scoped_lock lock{mProbeMutex};
+            mProbing.erase(display->connector());
+            if (mProbing.empty())
+                mProbeOrder.clear();
+        }
+        mProbeCondition.notify_all();
+
+        // The hotplug was not reported while probing
+        report(*display);
+    }
+}
+
+bool DrmDevice::probing(const DrmDisplay& display) {
+    std::scoped_lock lock{mProbeMutex};
+    return mProbing.count(display.connector());
+}
 
-    // Create displays for each connector
-    for (auto i = 0; i < res->count_connectors; ++i) {
-        mDisplays.insert({res->connectors[i],
-            std::make_unique<DrmDisplay>(*this, res->connectors[i])});
+bool DrmDevice::primaryProbed() const {
+    // All displays that might be reported before the primary display must be probed
+    for (const auto& display : mProbeOrder) {
+        if (mProbing.count(display->connector()))
+            return false;
+        if (display->connected())
+            return true;
     }
     return true;
 }
 
+std::vector<std::shared_ptr<DrmDisplay>> DrmDevice::updateConnectors(const drmModeRes& res) {
+    std::vector<std::shared_ptr<DrmDisplay>> added, removed;
+    {
+        std::scoped_lock lock{mDisplaysMutex};
+        for (auto i = mDisplays.begin(); i != mDisplays.end();) {
+            if (std::find(res.connectors, res.connectors + res.count_connectors, i->first)
+                    == res.connectors + res.count_connectors) {
+                removed.push_back(std::move(i->second));
+                i = mDisplays.erase(i);
+            } else {
+                ++i;
+            }
+        }
+
+        for (auto i = 0; i < res.count_connectors; ++i) {
+            auto [it, inserted] = mDisplays.try_emplace(res.connectors[i]);
+            if (inserted) {
+                it->second = std::make_shared<DrmDisplay>(*this, res.connectors[i]);
+                added.push_back(it->second);
+            }
+        }
+    }
+
+    for (auto& display : removed) {
+        LOG(INFO) << "Connector " << display->connector() << " was removed";
+        display->remove();
+    }
+    return added;
+}
+
 void DrmDevice::update() {
-    // TODO: Add new (hotplug) connectors (mostly relevant for DP MST)
-    for (auto& p : mDisplays) {
-        p.second->update();
+    // Connectors may be added or removed on hotplug (e.g. DP MST)
+    drm::mode::unique_res_ptr res{drmModeGetResources(mFd)};
+    if (res) {
+        // Displays are only probed after adding them, so they can be found once reported
+        for (auto& display : updateConnectors(*res))
+            display->update(true);
+    } else {
+        PLOG(ERROR) << "Failed to get DRM mode resources";
+    }
+
+    for (auto& display : displays()) {
+        display->update();
     }
 }
 
+void DrmDevice::update(uint32_t connector) {
+    // Only probed if the current state of the connector has changed
+    if (auto display = getDisplay(connector))
+        display->update();
+    else
+        update(); // Possibly a new connector
+}
+
+void DrmDevice::hotplug(uint32_t connector) {
+    mHotplugThread.schedule(connector);
+}
+
 void DrmDevice::enable(DrmCallback *callback) {
-    update();
+    // Displays that are still probed would block, they are reported afterwards
+    auto displays = this->displays();
+    for (auto& display : displays) {
+        if (!probing(*display))
+            display->update();
+    }
+
+    std::scoped_lock lock{mReportMutex};
     mCallback = callback;
+    mReported.clear();
+
+    auto reportable = [this] (const auto& display) {
+        return display->connected() && !probing(*display);
+    };
 
     // Attempt to report a "primary" (internal) display first
-    auto primary = std::find_if(mDisplays.begin(), mDisplays.end(),
-        [] (const auto& pair) {
-            return pair.second->connected() && pair.second->internal();
+    auto primary = std::find_if(displays.begin(), displays.end(),
+        [&reportable] (const auto& display) {
+            return reportable(display) && display->internal();
         });
-    if (primary != mDisplays.end()) {
-        LOG(INFO) << "Reporting display " << *primary->second
+    if (primary != displays.end()) {
+        LOG(INFO) << "Reporting display " << **primary
             << " as primary display";
-        primary->second->report();
+        reportLocked(**primary);
     }
 
-    for (auto i = mDisplays.begin(), end = mDisplays.end(); i != end; ++i) {
+    for (auto i = displays.begin(), end = displays.end(); i != end; ++i) {
         if (i == primary)
             continue; // Primary display is already reported
 
-        auto display = i->second.get();
-        if (display->connected()) {
-            display->report();
+        auto& display = *i;
+        if (reportable(display)) {
+            reportLocked(*display);
         }
     }
-
-    mHotplugThread.enable();
 }
 
 void DrmDevice::disable() {
-    mHotplugThread.disable();
+    {
+        std::scoped_lock lock{mReportMutex};
+        mCallback = nullptr;
+        mReported.clear();
+    }
+    for (auto& display : displays()) {
+        display->disable();
+    }
+}
 
-    mCallback = nullptr;
-    for (auto& p : mDisplays) {
-        p.second->disable();
+void DrmDevice::dumpWakeupLatency(std::ostream& os, const char* indent) {
+    os << indent << mEventThread.name() << ": " << mEventThread.latency() << "\n"
+       << indent << mHotplugThread.name() << ": " << mHotplugThread.latency() << "\n";
+    for (const auto& display : displays()) {
+        const auto& thread = display->commitThread();
+        os << indent << thread.name() << ": " << thread.latency() << "\n";
     }
 }
 
+void DrmDevice::report(const DrmDisplay& display) {
+    if (probing(display))
+        return; // Reported by the probe thread once it has finished
+
+    std::scoped_lock lock{mReportMutex};
+    reportLocked(display);
+}
+
+void DrmDevice::reportLocked(const DrmDisplay& display) {
+    if (!mCallback)
+        return;
+
+    // The probe thread and the hotplug thread might both report the same change
+    auto connected = display.connected();
+    if (connected == !!mReported.count(display.eventToken()))
+        return;
+
+    if (connected)
+        mReported.insert(display.eventToken());
+    else
+        mReported.erase(display.eventToken());
+    mCallback->onHotplug(display, connected);
+}
+
 }  // namespace drmfb
 }  // namespace V2_1
 }  // namespace composer
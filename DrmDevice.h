@@ -3,12 +3,20 @@
 
 #pragma once
 
+#include <condition_variable>
 #include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
 #include <vector>
 #include <unordered_map>
+#include <unordered_set>
 #include <android-base/unique_fd.h>
 #include "DrmDisplay.h"
 #include "DrmCallback.h"
+#include "DrmFramebufferCache.h"
+#include "DrmEventThread.h"
+#include "DrmGemHandleTable.h"
 #include "DrmHotplugThread.h"
 
 namespace android {
@@ -19,36 +27,126 @@ namespace V2_1 {
 namespace drmfb {
 
 struct DrmDevice {
-    DrmDevice(int fd);
-    DrmDevice(const std::string& path);
-    DrmDevice();
+    DrmDevice(int fd, unsigned index);
+    DrmDevice(const std::string& path, unsigned index);
+    ~DrmDevice();
 
     inline int fd() const { return mFd; }
+    inline unsigned index() const { return mIndex; } // Upper 32 bits of the display IDs
+    inline DrmGemHandleTable& gemHandles() { return mGemHandles; }
+    inline DrmFramebufferCache& framebuffers() { return mFramebuffers; }
+    inline DrmEventThread& events() { return mEventThread; }
 
-    DrmDisplay* getConnectedDisplay(uint32_t connector);
+    std::shared_ptr<DrmDisplay> getDisplay(uint32_t connector);
+    std::shared_ptr<DrmDisplay> getConnectedDisplay(uint32_t connector);
+    std::shared_ptr<DrmDisplay> getEventDisplay(uint32_t token); // See DrmDisplay::eventToken()
+    bool presentFences() const;
 
-    inline const std::vector<uint32_t>& crtcs() { return mCrtcs; }
-    uint32_t reserveCrtc(unsigned pipe);
-    void freeCrtc(unsigned pipe);
+    /*
+     * Assigns one of the possible CRTCs (bitmask of pipes) to the display.
+     * If all of them are in use, other displays may be moved to another CRTC
+     * to make room (maximum bipartite matching of displays and CRTCs).
+     */
+    bool assignCrtc(DrmDisplay& display, uint32_t possibleCrtcs);
+    void freeCrtc(unsigned pipe, uint32_t connector);
+    inline uint32_t overlayPlane(unsigned pipe) const {
+        return pipe < mCrtcs.size() ? mCrtcs[pipe].overlay : 0;
+    }
+    inline uint32_t gammaSize(unsigned pipe) const {
+        return pipe < mCrtcs.size() ? mCrtcs[pipe].gammaSize : 0;
+    }
+    inline uint32_t ctmProperty(unsigned pipe) const {
+        return pipe < mCrtcs.size() ? mCrtcs[pipe].ctm : 0;
+    }
+    // Whether all CRTCs can apply any color transform (using the gamma LUT and CTM),
+    // or only diagonal ones that scale and offset each channel (gamma LUT only)
+    bool colorTransforms(bool diagonal = false) const;
 
     bool initialize();
     void update();
+    void update(uint32_t connector);
+    void hotplug(uint32_t connector = 0); // Called from the event thread, 0 for all
 
     inline DrmCallback* callback() { return mCallback; }
     void enable(DrmCallback *callback);
     void disable();
+    void report(const DrmDisplay& display); // Hotplug, unless the display is still probed
+
+    void dumpWakeupLatency(std::ostream& os, const char* indent);
 
 private:
+    std::vector<std::shared_ptr<DrmDisplay>> displays();
+    // Returns the added displays, they still need to be probed
+    std::vector<std::shared_ptr<DrmDisplay>> updateConnectors(const drmModeRes& res);
+
+    void probe(std::vector<std::shared_ptr<DrmDisplay>> displays);
+    void probeThread(std::vector<std::shared_ptr<DrmDisplay>> displays);
+    bool probing(const DrmDisplay& display);
+    bool primaryProbed() const;
+    void reportLocked(const DrmDisplay& display);
+
     base::unique_fd mFd;
+    const unsigned mIndex;
+    DrmGemHandleTable mGemHandles;
+    DrmFramebufferCache mFramebuffers;
+
+    /*
+     * Connector -> Display. Connectors may be added and removed at runtime
+     * (e.g. DP MST), so the displays are shared with the callers.
+     */
+    mutable std::mutex mDisplaysMutex;
+    std::unordered_map<uint32_t, std::shared_ptr<DrmDisplay>> mDisplays;
+
+    struct Crtc {
+        uint32_t id;
+        bool cursor = false; // Has a cursor plane
+        unsigned overlays = 0; // Number of overlay planes
+        uint32_t overlay = 0; // Overlay plane only used by this CRTC (e.g. for scaling)
+        uint32_t gammaSize = 0; // Entries of the (legacy) gamma LUT
+        uint32_t ctm = 0; // ID of the CTM property (color transformation matrix)
+
+        uint32_t owner = 0; // Connector of the display using the CRTC
+        uint32_t ownerCrtcs = 0; // Possible CRTCs of the owner (to move it)
+    };
+    struct Move {
+        uint32_t connector;
+        unsigned pipe; // The new CRTC of the display
+        uint32_t possibleCrtcs;
+    };
+
+    void probePlanes();
+    void probeColor();
+    bool findCrtc(uint32_t connector, uint32_t possibleCrtcs, bool preferPlanes,
+                  uint32_t preferredCrtc, std::vector<Move>* moves);
+
+    std::vector<Crtc> mCrtcs; // By pipe
+    std::mutex mCrtcMutex; // Protects the owners of the CRTCs
+    std::mutex mAssignMutex; // Held while displays are moved to another CRTC
 
-    // Connector -> Display
-    std::unordered_map<uint32_t, std::unique_ptr<DrmDisplay>> mDisplays;
+    /*
+     * Probing a connector (e.g. reading the EDID) may take a long time, even
+     * if nothing is connected. At startup, the connectors are probed one after
+     * another on a background thread (internal ones first; the kernel would
+     * serialize concurrent probes anyway), and initialize() only waits until
+     * the primary display is known. The other displays are reported once probed.
+     */
+    std::mutex mProbeMutex;
+    std::condition_variable mProbeCondition;
+    std::vector<std::shared_ptr<DrmDisplay>> mProbeOrder; // Internal displays first
+    std::unordered_set<uint32_t> mProbing; // Connectors whose probe has not finished
+    std::thread mProbeThread;
+    bool mProbeStopped = false;
 
-    std::vector<uint32_t> mCrtcs;
-    uint32_t mUsedCrtcs = 0; // The CRTCs that are already being used by a display
+    /*
+     * Serializes hotplug reports, so each change is reported exactly once
+     * and in order. mProbeMutex is never held while reporting.
+     */
+    std::mutex mReportMutex;
+    std::unordered_set<uint32_t> mReported; // Event tokens of displays reported as connected
 
     DrmHotplugThread mHotplugThread;
-    DrmCallback* mCallback = nullptr;
+    DrmEventThread mEventThread;
+    DrmCallback* mCallback = nullptr; // Set with mReportMutex held
 };
 
 }  // namespace drmfb
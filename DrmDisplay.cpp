@@ -3,9 +3,17 @@
 
 #define LOG_TAG "drmfb-display"
 
+#include <algorithm>
 #include <array>
+#include <cmath>
+#include <cstring>
+#include <utility>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/timerfd.h>
 #include <xf86drm.h>
 #include <android-base/logging.h>
+#include <sync/sync.h>
 #include "drm_unique_ptr.h"
 #include "DrmDisplay.h"
 #include "DrmDevice.h"
@@ -36,91 +44,268 @@ std::ostream& operator<<(std::ostream& os, const drmModeModeInfo& mode) {
 
 constexpr int32_t SECOND_NANOS = 1'000'000'000;
 constexpr int32_t KINCH_MILLIMETER = 25400;
+constexpr int64_t DEFAULT_PERIOD = SECOND_NANOS / 60; // 60 Hz
+constexpr int64_t RESYNC_INTERVAL = 2LL * SECOND_NANOS; // Hardware sample at least every 2s
+constexpr auto FLIP_TIMEOUT = std::chrono::seconds(1);
+constexpr int CURSOR_FENCE_TIMEOUT = 1000; // ms
+
+// The blob of a connector property (empty if there is none)
+std::vector<uint8_t> getBlob(int fd, const drmModeConnector& connector, const char* name) {
+    for (auto i = 0; i < connector.count_props; ++i) {
+        drm::mode::unique_property_ptr property{drmModeGetProperty(fd, connector.props[i])};
+        if (!property || strcmp(property->name, name))
+            continue;
+
+        drm::mode::unique_blob_ptr blob{drmModeGetPropertyBlob(fd, connector.prop_values[i])};
+        if (!blob)
+            return {};
+
+        auto data = static_cast<const uint8_t*>(blob->data);
+        return {data, data + blob->length};
+    }
+    return {};
+}
+
+// The ID of a connector property (0 if there is none)
+uint32_t getPropertyId(int fd, const drmModeConnector& connector, const char* name) {
+    for (auto i = 0; i < connector.count_props; ++i) {
+        drm::mode::unique_property_ptr property{drmModeGetProperty(fd, connector.props[i])};
+        if (property && !strcmp(property->name, name))
+            return property->prop_id;
+    }
+    return 0;
+}
+
+// Exact frame period of a mode (see drm_mode_vrefresh() in the kernel)
+int64_t modePeriod(const drmModeModeInfo& mode) {
+    if (!mode.clock || !mode.htotal || !mode.vtotal)
+        return mode.vrefresh > 0 ? SECOND_NANOS / mode.vrefresh : 0;
+
+    int64_t num = mode.clock; // kHz
+    int64_t den = int64_t{mode.htotal} * mode.vtotal * 1'000'000;
+    if (mode.flags & DRM_MODE_FLAG_INTERLACE)
+        num *= 2;
+    if (mode.flags & DRM_MODE_FLAG_DBLSCAN)
+        den *= 2;
+    if (mode.vscan > 1)
+        den *= mode.vscan;
+    return (den + num / 2) / num;
+}
+
+// Converts to the S31.32 sign-magnitude format used by the CTM property
+uint64_t ctmValue(float value) {
+    auto magnitude = static_cast<uint64_t>(std::llround(std::fabs(value) * (1LL << 32)));
+    return (value < 0 ? 1ULL << 63 : 0) | (magnitude & ~(1ULL << 63));
+}
+
+// Whether two modes have the same timings (ignoring the name and type)
+bool sameTimings(const drmModeModeInfo& a, const drmModeModeInfo& b) {
+    return a.clock == b.clock
+        && a.hdisplay == b.hdisplay && a.hsync_start == b.hsync_start
+        && a.hsync_end == b.hsync_end && a.htotal == b.htotal && a.hskew == b.hskew
+        && a.vdisplay == b.vdisplay && a.vsync_start == b.vsync_start
+        && a.vsync_end == b.vsync_end && a.vtotal == b.vtotal && a.vscan == b.vscan
+        && a.flags == b.flags;
+}
+
+int64_t now() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return int64_t{ts.tv_sec} * SECOND_NANOS + ts.tv_nsec;
+}
+
+std::atomic<uint32_t> nextEventToken{1};
 }
 
 DrmDisplay::DrmDisplay(DrmDevice& device, uint32_t connectorId)
-    : mDevice(device), mConnector(connectorId), mVsyncThread(*this) {
-    update();
+    : mDevice(device), mConnector(connectorId),
+      mId(uint64_t{device.index()} << 32 | connectorId),
+      mEventToken(nextEventToken.fetch_add(1, std::memory_order_relaxed)),
+      mVsyncTimer(timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK)),
+      mCursor(device), mCommitThread(*this) {
+    if (mVsyncTimer < 0)
+        PLOG(ERROR) << "Failed to create vsync timer for connector " << mConnector;
+    else
+        mDevice.events().addTimer(mVsyncTimer, mEventToken);
 }
 
 DrmDisplay::~DrmDisplay() {
+    if (mVsyncTimer >= 0)
+        mDevice.events().removeTimer(mVsyncTimer);
     if (mCrtc)
-        mDevice.freeCrtc(mPipe);
+        mDevice.freeCrtc(mPipe, mConnector);
 }
 
 int32_t DrmDisplay::width(unsigned mode) const {
+    std::scoped_lock lock{mMutex};
     return mode < mModes.size() ? mModes[mode].hdisplay : -1;
 }
 
 int32_t DrmDisplay::height(unsigned mode) const {
+    std::scoped_lock lock{mMutex};
     return mode < mModes.size() ? mModes[mode].vdisplay : -1;
 }
 
 int32_t DrmDisplay::vsyncPeriod(unsigned mode) const {
+    std::scoped_lock lock{mMutex};
     if (mode >= mModes.size()) return -1;
-    auto refresh = mModes[mode].vrefresh;
-    return refresh > 0 ? SECOND_NANOS / mModes[mode].vrefresh : 0;
+    return modePeriod(mModes[mode]);
 }
 
 int32_t DrmDisplay::dpiX(unsigned mode) const {
+    std::scoped_lock lock{mMutex};
     if (mode >= mModes.size()) return -1;
     return mmWidth > 0 ? mModes[mode].hdisplay * KINCH_MILLIMETER / mmWidth : 0;
 }
 
 int32_t DrmDisplay::dpiY(unsigned mode) const {
+    std::scoped_lock lock{mMutex};
     if (mode >= mModes.size()) return -1;
     return mmHeight > 0 ? mModes[mode].vdisplay * KINCH_MILLIMETER / mmHeight : 0;
 }
 
-void DrmDisplay::update() {
-    drm::mode::unique_connector_ptr connector{
-        drmModeGetConnector(mDevice.fd(), mConnector)};
+void DrmDisplay::update(bool probe) {
+    std::scoped_lock updateLock{mUpdateMutex};
 
-    auto connected = false;
-    if (connector) {
-        connected = connector->connection == DRM_MODE_CONNECTED
-                        && connector->count_modes > 0;
-    } else {
+    /*
+     * drmModeGetConnector() probes the connector (e.g. reads the EDID),
+     * which may take a long time. The kernel has already detected the new
+     * connection state before sending the hotplug uevent, so the current
+     * state is enough to check if anything has changed.
+     */
+    drm::mode::unique_connector_ptr connector{probe
+        ? drmModeGetConnector(mDevice.fd(), mConnector)
+        : drmModeGetConnectorCurrent(mDevice.fd(), mConnector)};
+    if (!connector)
         PLOG(ERROR) << "Failed to get DRM connector " << mConnector;
+
+    auto connected = connector && connector->connection == DRM_MODE_CONNECTED;
+    if (connected && mConnected) {
+        /*
+         * The display may have been disconnected and connected again since
+         * the last update (e.g. a flaky cable). Nothing needs to be done
+         * unless it was replaced with a different display (e.g. KVM switch)
+         * or its modes have changed.
+         */
+        auto edid = getBlob(mDevice.fd(), *connector, "EDID");
+        auto replaced = !edid.empty() && edid != mEdid;
+        if (!replaced && sameModes(*connector))
+            return;
+
+        if (replaced)
+            LOG(INFO) << "Display " << *this << " was replaced (EDID changed)";
+        else
+            LOG(INFO) << "Modes of display " << *this << " have changed";
+        if (!probe)
+            connector.reset(drmModeGetConnector(mDevice.fd(), mConnector));
+        disconnect();
+        if (connector && connector->connection == DRM_MODE_CONNECTED
+                && connector->count_modes > 0)
+            connect(*connector);
+        return;
     }
 
     if (connected == mConnected)
         return; // Only update on hotplug
-    mConnected = connected;
 
-    if (connected) {
-        mType = connector->connector_type;
-        mName = connectorTypeName(connector->connector_type);
-        mName += '-' + std::to_string(connector->connector_type_id);
+    if (connected && !probe) {
+        // Probe the modes of the new display
+        connector.reset(drmModeGetConnector(mDevice.fd(), mConnector));
+        if (!connector)
+            PLOG(ERROR) << "Failed to probe DRM connector " << mConnector;
+    }
 
-        mmWidth = connector->mmWidth;
-        mmHeight = connector->mmHeight;
+    connected = connector && connector->connection == DRM_MODE_CONNECTED
+                    && connector->count_modes > 0;
+    if (connected == mConnected)
+        return;
 
-        setModes(connector->modes, connector->modes + connector->count_modes);
+    if (connected)
+        connect(*connector);
+    else
+        disconnect();
+}
+
+bool DrmDisplay::sameModes(const drmModeConnector& connector) const {
+    return std::equal(mConnectorModes.begin(), mConnectorModes.end(),
+        connector.modes, connector.modes + connector.count_modes,
+        [] (const auto& a, const auto& b) { return !memcmp(&a, &b, sizeof(a)); });
+}
+
+void DrmDisplay::remove() {
+    std::scoped_lock updateLock{mUpdateMutex};
+    // The connector does not exist anymore, so it cannot be probed
+    if (mConnected)
+        disconnect();
+}
+
+void DrmDisplay::connect(const drmModeConnector& connector) {
+    {
+        std::scoped_lock lock{mMutex};
+        mType = connector.connector_type;
+        mName = connectorTypeName(connector.connector_type);
+        mName += '-' + std::to_string(connector.connector_type_id);
+
+        mmWidth = connector.mmWidth;
+        mmHeight = connector.mmHeight;
+        mEdid = getBlob(mDevice.fd(), connector, "EDID");
+        mDpmsProperty = getPropertyId(mDevice.fd(), connector, "DPMS");
+
+        // DP MST connectors are created dynamically, the path identifies the port
+        auto path = getBlob(mDevice.fd(), connector, "PATH");
+        if (!path.empty()) {
+            mName += " (";
+            mName.append(path.begin(), std::find(path.begin(), path.end(), '\0'));
+            mName += ')';
+        }
+
+        mConnectorModes.assign(connector.modes, connector.modes + connector.count_modes);
+        setModes(connector.modes, connector.modes + connector.count_modes);
+        findBootMode(connector);
+        mConnected = true;
 
         LOG(INFO) << "Display " << *this << " connected, "
             << mModes.size() << " mode(s), "
             << "default: " << mModes[mCurrentMode];
-        report();
-    } else {
-        LOG(INFO) << "Display " << *this << " disconnected";
+    }
+    report();
+}
+
+void DrmDisplay::disconnect() {
+    LOG(INFO) << "Display " << *this << " disconnected";
+
+    disableVsync();
+    mCommitThread.flush(); // Must not be called with the lock held
 
-        disableVsync();
+    {
+        std::scoped_lock lock{mMutex};
+        mConnected = false;
+        signalPresented();
 
-        if (mCrtc)
-            mDevice.freeCrtc(mPipe);
+        if (mCrtc) {
+            disableOverlay();
+            mDevice.freeCrtc(mPipe, mConnector);
+        }
 
         mFlipPending = false;
+        mVblankPending = false;
         mModeSet = false;
+        mAdopted = false;
+        mDpms = DRM_MODE_DPMS_ON;
+        mCursorVisible = false;
         mCrtc = 0;
+        mBootCrtc = 0;
 
-        mFramebuffers.clear();
+        releaseFramebuffers();
         mModes.clear();
+        mEdid.clear();
+        mScalingBroken = false;
+    }
+    mFlipCondition.notify_all();
 
-        report();
+    report();
 
-        mVsyncThread.stop();
-    }
+    mCommitThread.stop();
 }
 
 void DrmDisplay::setModes(const drmModeModeInfo* begin, const drmModeModeInfo* end) {
@@ -159,9 +344,7 @@ void DrmDisplay::setModes(const drmModeModeInfo* begin, const drmModeModeInfo* e
 }
 
 void DrmDisplay::report() {
-    if (auto callback = mDevice.callback(); callback) {
-        callback->onHotplug(*this, mConnected);
-    }
+    mDevice.report(*this);
 }
 
 void DrmDisplay::vsync(int64_t timestamp) {
@@ -171,6 +354,7 @@ void DrmDisplay::vsync(int64_t timestamp) {
 }
 
 bool DrmDisplay::setMode(unsigned mode) {
+    std::scoped_lock lock{mMutex};
     if (mCurrentMode == mode)
         return true;
     if (mode >= mModes.size())
@@ -180,49 +364,79 @@ bool DrmDisplay::setMode(unsigned mode) {
 
     mCurrentMode = mode;
     mModeSet = false;
+    mAdopted = false;
     return true;
 }
 
-namespace {
-void handlePageFlip(int /*fd*/, unsigned int /*sequence*/,
-        unsigned int /*tv_sec */, unsigned int /*tv_usec*/, void* user_data) {
-    auto display = static_cast<DrmDisplay*>(user_data);
-    display->handlePageFlip();
-}
+unsigned DrmDisplay::findMode(int32_t width, int32_t height, int32_t vsyncPeriod) const {
+    std::scoped_lock lock{mMutex};
+    unsigned best = 0;
+    auto found = false;
+    int64_t bestDiff = 0;
+    for (unsigned i = 0; i < mModes.size(); ++i) {
+        const auto& mode = mModes[i];
+        if (mode.hdisplay != width || mode.vdisplay != height)
+            continue;
 
-drmEventContext pageFlipEvCtx = {
-    .version = DRM_EVENT_CONTEXT_VERSION,
-    .page_flip_handler = handlePageFlip,
-};
+        // The first one is kept if the periods are equally close (modes are ordered by preference)
+        auto diff = std::abs(modePeriod(mode) - vsyncPeriod);
+        if (!found || diff < bestDiff) {
+            best = i;
+            bestDiff = diff;
+            found = true;
+        }
+    }
+    return best;
 }
 
-void DrmDisplay::handlePageFlip() {
-    if (mFlipPending) {
+void DrmDisplay::handlePageFlip(int64_t timestamp) {
+    {
+        std::scoped_lock lock{mMutex};
+        if (!mFlipPending) {
+            if (mConnected) {
+                LOG(WARNING) << "handlePageFlip() called for display " << *this
+                    << " without flip pending";
+            }
+            return;
+        }
+
+        mFramebuffer = std::move(mFlipFramebuffer);
+        mTimeline.signal(mFlipSequence);
         mFlipPending = false;
-    } else if (mConnected) {
-        LOG(WARNING) << "handlePageFlip() called for display " << *this
-            << " without flip pending";
+
+        // Page flips complete on vblank, so they are free samples for the vsync model
+        mLastSample = timestamp;
+        if (!mVsyncModel.addSample(timestamp)) {
+            LOG(DEBUG) << "Page flip does not match vsync model of display " << *this;
+            updateVsync();
+        }
     }
+    mFlipCondition.notify_all();
 }
 
-void DrmDisplay::awaitPageFlip() const {
-    // Wait for the last page flip to complete
-    while (mFlipPending) {
-        if (drmHandleEvent(mDevice.fd(), &pageFlipEvCtx)) {
-            PLOG(ERROR) << "Failed to handle DRM event";
-            return;
-        }
+void DrmDisplay::awaitPageFlip(std::unique_lock<std::mutex>& lock) {
+    // Wait for the last page flip to complete (handled on the event thread)
+    if (!mFlipCondition.wait_for(lock, FLIP_TIMEOUT, [this] { return !mFlipPending; })) {
+        LOG(ERROR) << "Timeout while waiting for page flip on display " << *this;
+        mFramebuffer = std::move(mFlipFramebuffer);
+        mTimeline.signal(mFlipSequence);
+        mFlipPending = false;
     }
 }
 
 bool DrmDisplay::enable() {
-    if (enabled())
-        return true;
-    if (!mConnected)
-        return false;
+    {
+        std::scoped_lock lock{mMutex};
+        if (enabled()) {
+            resume();
+            return true;
+        }
+        if (!mConnected)
+            return false;
+    }
 
     drm::mode::unique_connector_ptr connector{
-        drmModeGetConnector(mDevice.fd(), mConnector)};
+        drmModeGetConnectorCurrent(mDevice.fd(), mConnector)};
 
     // Verify that the display is still connected, just to be sure
     if (!connector || connector->connection != DRM_MODE_CONNECTED) {
@@ -230,100 +444,776 @@ bool DrmDisplay::enable() {
         return false;
     }
 
-    LOG(INFO) << "Enabling display " << *this;
-
-    // Attempt to find a CRTC that is not used by any other display
+    // The CRTCs that can be used with any of the encoders
+    uint32_t possibleCrtcs = 0;
     for (auto i = 0; i < connector->count_encoders; ++i) {
         drm::mode::unique_encoder_ptr encoder{
             drmModeGetEncoder(mDevice.fd(), connector->encoders[i])};
-        if (!encoder) {
+        if (encoder)
+            possibleCrtcs |= encoder->possible_crtcs;
+        else
             PLOG(ERROR) << "Failed to get encoder " << connector->encoders[i];
-            continue;
-        }
+    }
 
-        for (mPipe = 0; mPipe < mDevice.crtcs().size(); ++mPipe) {
-            if (!(encoder->possible_crtcs & (1 << mPipe)))
-                continue;
-
-            mCrtc = mDevice.reserveCrtc(mPipe);
-            if (mCrtc) {
-                LOG(INFO) << "Using CRTC " << mCrtc << " for display " << *this;
-                return true;
-            } else {
-                LOG(WARNING) << "CRTC " << mDevice.crtcs()[mPipe]
-                    << " for display " << *this
-                    << " is already in use by another display";
-            }
-        }
+    LOG(INFO) << "Enabling display " << *this;
+
+    // Calls setCrtc() (also for other displays that are moved), must not hold the lock
+    return mDevice.assignCrtc(*this, possibleCrtcs);
+}
+
+bool DrmDisplay::setDpms(uint64_t dpms) {
+    std::unique_lock lock{mMutex};
+    if (!mDpmsProperty || !mModeSet)
+        return false;
+    if (mDpms == dpms)
+        return true;
+
+    // The last frame must be displayed before turning the display off
+    awaitPageFlip(lock);
+
+    LOG(INFO) << "Setting DPMS " << dpms << " for display " << *this;
+    if (drmModeConnectorSetProperty(mDevice.fd(), mConnector, mDpmsProperty, dpms)) {
+        PLOG(ERROR) << "Failed to set DPMS " << dpms << " for display " << *this;
+        return false;
     }
 
-    LOG(ERROR) << "Failed to find CRTC for display " << *this;
-    return false;
+    mDpms = dpms;
+    if (dpms != DRM_MODE_DPMS_ON) {
+        // There are no vblank events while the display is off
+        mVblankPending = false;
+        cancelVsyncTimer();
+        signalPresented();
+    }
+    return true;
 }
 
-void DrmDisplay::disable() {
-    if (!enabled())
+void DrmDisplay::resume() {
+    if (mDpms == DRM_MODE_DPMS_ON)
+        return;
+
+    LOG(INFO) << "Turning display " << *this << " on again";
+    if (drmModeConnectorSetProperty(mDevice.fd(), mConnector, mDpmsProperty,
+            DRM_MODE_DPMS_ON)) {
+        PLOG(ERROR) << "Failed to turn display " << *this << " on, setting mode again";
+        mModeSet = false; // The mode set on the next frame turns it on
+    }
+    mDpms = DRM_MODE_DPMS_ON;
+
+    // The timings might have changed slightly, fit the vsync model again
+    resetVsync();
+    updateVsync();
+}
+
+bool DrmDisplay::hasCrtc() const {
+    std::scoped_lock lock{mMutex};
+    return enabled();
+}
+
+bool DrmDisplay::needsPlanes() const {
+    std::scoped_lock lock{mMutex};
+    return mCursorVisible;
+}
+
+uint32_t DrmDisplay::preferredCrtc() const {
+    std::scoped_lock lock{mMutex};
+    return mBootCrtc;
+}
+
+void DrmDisplay::findBootMode(const drmModeConnector& connector) {
+    mBootCrtc = 0;
+
+    drm::mode::unique_encoder_ptr encoder{connector.encoder_id
+        ? drmModeGetEncoder(mDevice.fd(), connector.encoder_id) : nullptr};
+    drm::mode::unique_crtc_ptr crtc{encoder && encoder->crtc_id
+        ? drmModeGetCrtc(mDevice.fd(), encoder->crtc_id) : nullptr};
+    if (!crtc || !crtc->mode_valid || !crtc->buffer_id)
+        return;
+
+    auto mode = std::find_if(mModes.begin(), mModes.end(),
+        [&crtc] (const auto& mode) { return sameTimings(mode, crtc->mode); });
+    if (mode == mModes.end())
+        return; // Not exposed, the mode is set again anyway
+
+    mCurrentMode = mode - mModes.begin();
+    mBootCrtc = crtc->crtc_id;
+    LOG(INFO) << "Display " << *this << " already has mode " << *mode
+        << " on CRTC " << mBootCrtc;
+}
+
+bool DrmDisplay::adoptBootMode() {
+    // Check that nothing has changed in the meantime (e.g. another display used the CRTC)
+    drm::mode::unique_crtc_ptr crtc{drmModeGetCrtc(mDevice.fd(), mCrtc)};
+    drm::mode::unique_connector_ptr connector{
+        drmModeGetConnectorCurrent(mDevice.fd(), mConnector)};
+    drm::mode::unique_encoder_ptr encoder{connector && connector->encoder_id
+        ? drmModeGetEncoder(mDevice.fd(), connector->encoder_id) : nullptr};
+    if (!crtc || !crtc->mode_valid || !crtc->buffer_id || !encoder || encoder->crtc_id != mCrtc
+            || mCurrentMode >= mModes.size() || !sameTimings(crtc->mode, mModes[mCurrentMode]))
+        return false;
+
+    LOG(INFO) << "Keeping mode " << mModes[mCurrentMode] << " of display " << *this;
+    mModeSet = true;
+    mAdopted = true;
+    resetVsync();
+    updateVsync();
+    applyCursor();
+    applyColorTransform();
+    return true;
+}
+
+void DrmDisplay::setCrtc(unsigned pipe, uint32_t crtc, bool move) {
+    std::unique_lock lock{mMutex};
+    if (!move) {
+        LOG(INFO) << "Using CRTC " << crtc << " for display " << *this;
+        mPipe = pipe;
+        mCrtc = crtc;
+
+        // Only once, the CRTC is turned off when the display is disabled
+        if (std::exchange(mBootCrtc, 0) == crtc)
+            adoptBootMode();
+        return;
+    }
+
+    if (!enabled()) {
+        // Disabled in the meantime, the new CRTC is not needed anymore
+        mDevice.freeCrtc(pipe, mConnector);
+        return;
+    }
+
+    LOG(INFO) << "Moving display " << *this << " from CRTC " << mCrtc
+        << " to CRTC " << crtc << " to make room for another display";
+
+    awaitPageFlip(lock);
+    auto wasModeSet = mModeSet;
+    if (mModeSet) {
+        // The CRTC is used by another display next
+        disableOverlay();
+        if (drmModeSetCrtc(mDevice.fd(), mCrtc, 0, 0, 0, nullptr, 0, nullptr))
+            PLOG(ERROR) << "Failed to disable CRTC " << mCrtc << " of display " << *this;
+        mModeSet = false;
+        mVblankPending = false;
+    }
+
+    mPipe = pipe;
+    mCrtc = crtc;
+
+    // The mode set would also turn it on, so wait for the next frame if it is off
+    if (mDpms != DRM_MODE_DPMS_ON) {
+        mDpms = DRM_MODE_DPMS_ON;
         return;
+    }
+
+    // Display the last frame again, without waiting for the next one
+    if (wasModeSet && mFramebuffer) {
+        if (!modeSet(*mFramebuffer)) {
+            PLOG(ERROR) << "Failed to enable CRTC " << mCrtc << " for display " << *this;
+        } else {
+            mModeSet = true;
+            resetVsync();
+            updateVsync();
+            applyCursor();
+            applyColorTransform();
+        }
+    }
+}
+
+void DrmDisplay::disable() {
+    {
+        std::scoped_lock lock{mMutex};
+        if (!enabled())
+            return;
+    }
 
     LOG(INFO) << "Disabling display " << *this;
 
+    // Must not be called with the lock held
+    mCommitThread.flush();
+
+    std::unique_lock lock{mMutex};
+    if (!enabled())
+        return;
+
+    awaitPageFlip(lock);
     if (mModeSet) {
-        mVsyncThread.disable();
-        awaitPageFlip();
+        disableOverlay();
         if (drmModeSetCrtc(mDevice.fd(), mCrtc, 0, 0, 0, nullptr, 0, nullptr)) {
             PLOG(ERROR) << "Failed to disable display " << *this;
         }
         mModeSet = false;
+        mAdopted = false;
+        mVblankPending = false; // No more vblank events after disabling the CRTC
     }
-    mDevice.freeCrtc(mPipe);
+    mDpms = DRM_MODE_DPMS_ON; // Turned on by the next mode set
+    signalPresented();
+    releaseFramebuffers();
+    mDevice.freeCrtc(mPipe, mConnector);
     mCrtc = 0;
 }
 
+void DrmDisplay::setColorTransform(const float* matrix) {
+    std::scoped_lock lock{mMutex};
+    mColorTransformIdentity = !matrix;
+    if (matrix)
+        std::copy(matrix, matrix + mColorTransform.size(), mColorTransform.begin());
+    applyColorTransform();
+}
+
+void DrmDisplay::bypassColorTransform(bool bypass) {
+    std::scoped_lock lock{mMutex};
+    mColorTransformBypass = bypass;
+}
+
+bool DrmDisplay::diagonalColorTransform(const float* m) {
+    return m[1] == 0 && m[2] == 0 && m[4] == 0 && m[6] == 0 && m[8] == 0 && m[9] == 0;
+}
+
+void DrmDisplay::applyColorTransform() {
+    if (!mModeSet)
+        return; // Applied after the next mode set
+
+    auto size = mDevice.gammaSize(mPipe);
+    if (size < 2)
+        return;
+
+    /*
+     * The output for each channel c is the sum of in[k] * m[k * 4 + c]
+     * with the offset in m[12 + c]. Matrices that only scale each channel
+     * (e.g. night light) are applied using the gamma LUT only. Otherwise,
+     * the CTM is applied first and the offsets are added using the LUT.
+     */
+    static constexpr std::array<float, 16> IDENTITY{
+        1, 0, 0, 0,  0, 1, 0, 0,  0, 0, 1, 0,  0, 0, 0, 1};
+    auto& m = mColorTransformIdentity || mColorTransformBypassed ? IDENTITY : mColorTransform;
+    auto diagonal = diagonalColorTransform(m.data());
+
+    auto ctm = mDevice.ctmProperty(mPipe);
+    if (!diagonal && !ctm) {
+        LOG(ERROR) << "Color transform not supported by CRTC " << mCrtc
+            << " of display " << *this;
+        return;
+    }
+
+    if (ctm) {
+        uint32_t blob = 0;
+        if (!diagonal) {
+            drm_color_ctm matrix;
+            for (int i = 0; i < 3; ++i) {
+                for (int j = 0; j < 3; ++j)
+                    matrix.matrix[i * 3 + j] = ctmValue(m[j * 4 + i]);
+            }
+            if (drmModeCreatePropertyBlob(mDevice.fd(), &matrix, sizeof(matrix), &blob)) {
+                PLOG(ERROR) << "Failed to create CTM blob for display " << *this;
+                return;
+            }
+        }
+
+        // The property keeps a reference to the blob
+        if (drmModeObjectSetProperty(mDevice.fd(), mCrtc, DRM_MODE_OBJECT_CRTC, ctm, blob))
+            PLOG(ERROR) << "Failed to set CTM of display " << *this;
+        if (blob)
+            drmModeDestroyPropertyBlob(mDevice.fd(), blob);
+    }
+
+    std::vector<uint16_t> lut(size * 3);
+    for (int c = 0; c < 3; ++c) {
+        auto scale = diagonal ? m[c * 4 + c] : 1.0f;
+        for (uint32_t i = 0; i < size; ++i) {
+            auto value = scale * i / (size - 1) + m[12 + c];
+            lut[c * size + i] = static_cast<uint16_t>(std::lround(
+                std::clamp(value, 0.0f, 1.0f) * 0xffff));
+        }
+    }
+    if (drmModeCrtcSetGamma(mDevice.fd(), mCrtc, size,
+            &lut[0], &lut[size], &lut[size * 2]))
+        PLOG(ERROR) << "Failed to set gamma LUT of display " << *this;
+}
+
 void DrmDisplay::enableVsync() {
+    std::scoped_lock lock{mMutex};
     mVsyncEnabled = true;
-    if (mModeSet) {
-        mVsyncThread.enable();
-    }
+    updateVsync();
 }
 
 void DrmDisplay::disableVsync() {
+    std::scoped_lock lock{mMutex};
     mVsyncEnabled = false;
-    mVsyncThread.disable();
+
+    // A pending vblank event is ignored, but the timer can be stopped
+    cancelVsyncTimer();
 }
 
-void DrmDisplay::present(buffer_handle_t buffer) {
-    if (!enabled())
+int64_t DrmDisplay::period() const {
+    auto p = mVsyncModel.period();
+    return p > 0 ? p : DEFAULT_PERIOD;
+}
+
+void DrmDisplay::resetVsync() {
+    auto p = mCurrentMode < mModes.size() ? modePeriod(mModes[mCurrentMode]) : 0;
+    mVsyncModel.reset(p > 0 ? p : DEFAULT_PERIOD);
+    mVblankBroken = false;
+    mLastSample = 0;
+}
+
+void DrmDisplay::updateVsync() {
+    if (!mVsyncEnabled || !mModeSet || mDpms != DRM_MODE_DPMS_ON)
         return;
 
-    auto& fb = mFramebuffers.try_emplace(buffer, mDevice, buffer).first->second;
-    if (!fb.id()) {
+    /*
+     * Until the model is locked to the hardware, vsync is reported directly
+     * from vblank events. Afterwards, it is predicted using a timer and only
+     * a single vblank event is requested once in a while to verify the model
+     * (page flips provide additional samples).
+     */
+    if (!mVsyncModel.locked()) {
+        cancelVsyncTimer();
+        requestVblank();
+        if (mVsyncModel.locked()) // Vblank events are not available
+            scheduleVsync();
+        return;
+    }
+
+    if (now() - mLastSample > RESYNC_INTERVAL)
+        requestVblank();
+    scheduleVsync();
+}
+
+void DrmDisplay::requestVblank() {
+    if (mVblankPending)
+        return;
+
+    if (!mVblankBroken) {
+        auto highCrtc = mPipe << DRM_VBLANK_HIGH_CRTC_SHIFT;
+        drmVBlank vBlank{ .request = {
+            .type = static_cast<drmVBlankSeqType>(DRM_VBLANK_RELATIVE | DRM_VBLANK_EVENT
+                | (highCrtc & DRM_VBLANK_HIGH_CRTC_MASK)),
+            .sequence = 1,
+            .signal = mEventToken, // The display might be destroyed before the event
+        }};
+
+        if (!drmWaitVBlank(mDevice.fd(), &vBlank)) {
+            mVblankPending = true;
+            return;
+        }
+
+        PLOG(ERROR) << "drmWaitVBlank failed for display " << *this
+            << ", using vsync model without hardware samples";
+        mVblankBroken = true; // Until the next mode set
+    }
+
+    // Continue with the nominal period (or what was fitted from page flips)
+    if (!mVsyncModel.locked())
+        mVsyncModel.assume(now());
+}
+
+void DrmDisplay::scheduleVsync() {
+    // Skip vsyncs that were already reported (e.g. from a vblank event)
+    mVsyncTarget = mVsyncModel.predict(std::max(now(), mVsyncTimestamp + period() / 2));
+
+    itimerspec spec{ .it_value = {
+        .tv_sec = static_cast<time_t>(mVsyncTarget / SECOND_NANOS),
+        .tv_nsec = static_cast<long>(mVsyncTarget % SECOND_NANOS),
+    }};
+    if (timerfd_settime(mVsyncTimer, TFD_TIMER_ABSTIME, &spec, nullptr)) {
+        PLOG(ERROR) << "Failed to schedule vsync timer for display " << *this;
+    }
+}
+
+void DrmDisplay::cancelVsyncTimer() {
+    itimerspec spec{};
+    timerfd_settime(mVsyncTimer, 0, &spec, nullptr);
+}
+
+bool DrmDisplay::reportVsync(int64_t timestamp) {
+    // The same vsync might be reported by both the timer and a vblank event
+    if (timestamp <= mVsyncTimestamp + period() / 2)
+        return false;
+
+    mVsyncTimestamp = timestamp;
+    return true;
+}
+
+void DrmDisplay::handleVblank(int64_t timestamp) {
+    {
+        std::scoped_lock lock{mMutex};
+        mVblankPending = false;
+        mOverlayFramebuffer.reset(); // Replaced on the overlay plane by now
+        if (mSignalOnVblank) {
+            mTimeline.signal(mVblankSequence);
+            mSignalOnVblank = false;
+        }
+        if (!mModeSet)
+            return;
+
+        mLastSample = timestamp;
+        if (!mVsyncModel.addSample(timestamp))
+            LOG(DEBUG) << "Vblank does not match vsync model of display " << *this;
+
+        if (!mVsyncEnabled)
+            return;
+
+        updateVsync();
+        if (!reportVsync(timestamp))
+            return;
+    }
+
+    vsync(timestamp);
+}
+
+void DrmDisplay::handleTimer() {
+    uint64_t expirations;
+    if (read(mVsyncTimer, &expirations, sizeof(expirations)) < 0)
+        return;
+
+    int64_t timestamp;
+    {
+        std::scoped_lock lock{mMutex};
+        mDevice.events().recordWakeup(mVsyncTarget); // The timer expired at the target
+
+        if (!mVsyncEnabled || !mModeSet || mDpms != DRM_MODE_DPMS_ON || !mVsyncModel.locked())
+            return;
+
+        timestamp = mVsyncTarget;
+        auto report = reportVsync(timestamp);
+        updateVsync();
+        if (!report)
+            return;
+    }
+
+    vsync(timestamp);
+}
+
+bool DrmDisplay::supportsScanout(buffer_handle_t buffer) const {
+    BufferInfo info;
+    if (!buffer || !getBufferInfo(buffer, &info) || !drmfb::supportsScanout(info))
+        return false;
+
+    std::scoped_lock lock{mMutex};
+    return mCurrentMode < mModes.size()
+        && info.width == mModes[mCurrentMode].hdisplay
+        && info.height == mModes[mCurrentMode].vdisplay;
+}
+
+void DrmDisplay::releaseFramebuffers() {
+    mFramebuffer.reset();
+    mFlipFramebuffer.reset();
+    mOverlayFramebuffer.reset();
+    mBackground.reset();
+    mDevice.framebuffers().trim();
+}
+
+void DrmDisplay::signalPresented() {
+    // Signal all remaining present fences (e.g. for frames that were dropped)
+    mTimeline.signal(mSequence);
+    mSignalOnVblank = false;
+}
+
+void DrmDisplay::signalOnVblank(uint32_t sequence) {
+    // The frame is still displayed on the next vblank
+    mVblankSequence = sequence;
+    mSignalOnVblank = true;
+
+    requestVblank();
+    if (!mVblankPending) {
+        // Vblank events are not available
+        mTimeline.signal(sequence);
+        mSignalOnVblank = false;
+    }
+}
+
+base::unique_fd DrmDisplay::present(buffer_handle_t buffer, base::unique_fd acquireFence,
+        bool damaged) {
+    return present(mDevice.framebuffers().get(buffer), std::move(acquireFence), damaged);
+}
+
+base::unique_fd DrmDisplay::present(std::shared_ptr<const DrmFramebuffer> fb,
+        base::unique_fd acquireFence, bool damaged, std::shared_ptr<SoftwareFrame> frame,
+        bool replace) {
+    if (!fb->id()) {
         // The framebuffer error was already logged
+        return {};
+    }
+
+    base::unique_fd presentFence;
+    uint32_t sequence;
+    bool bypassColorTransform;
+    {
+        std::scoped_lock lock{mMutex};
+        if (!enabled())
+            return {};
+
+        sequence = ++mSequence;
+        presentFence = mTimeline.createFence(sequence);
+        bypassColorTransform = mColorTransformBypass;
+    }
+
+    // Might block if the queue is full, so the lock must not be held
+    mCommitThread.queue(std::move(fb), std::move(acquireFence), sequence, damaged,
+                        bypassColorTransform, std::move(frame), replace);
+    return presentFence;
+}
+
+void DrmDisplay::commit(std::shared_ptr<const DrmFramebuffer> fb, uint32_t sequence,
+        bool damaged, bool bypassColorTransform) {
+    std::unique_lock lock{mMutex};
+
+    // Skip the page flip if the frame is already displayed (or about to be)
+    if (!damaged && mModeSet && mDpms == DRM_MODE_DPMS_ON
+            && fb == (mFlipPending ? mFlipFramebuffer : mFramebuffer)) {
+        if (mFlipPending)
+            mFlipSequence = sequence; // Signaled together with the pending flip
+        else
+            signalOnVblank(sequence);
         return;
     }
 
-    awaitPageFlip();
+    awaitPageFlip(lock);
+
+    if (fb->needsCopy()) {
+        /*
+         * Buffers from other devices are copied once the acquire fence has
+         * signaled and the framebuffer is no longer displayed. Only this
+         * thread performs page flips, so the lock is not needed for copying.
+         */
+        lock.unlock();
+        fb->copy();
+        lock.lock();
+    }
+
+    if (!enabled() || mDpms != DRM_MODE_DPMS_ON) {
+        mTimeline.signal(sequence); // The frame is dropped while the display is off
+        return;
+    }
+
+    // Changed right before the page flip, so it matches the contents of the frame
+    if (bypassColorTransform != mColorTransformBypassed) {
+        mColorTransformBypassed = bypassColorTransform;
+        applyColorTransform();
+    }
+
+    // Switch between scaling and direct scanout (e.g. the mirrored display changed its mode)
+    if (mModeSet && needsScaling(*fb) != !!mOverlay)
+        mModeSet = false;
+
+    if (mModeSet && mOverlay) {
+        // Overlay planes are updated on the next vblank, there is no page flip event
+        if (!showScaled(*fb)) {
+            mTimeline.signal(sequence);
+            mModeSet = false; // Show it unscaled with the next frame
+            return;
+        }
+        mOverlayFramebuffer = std::move(mFramebuffer);
+        mFramebuffer = std::move(fb);
+        signalOnVblank(sequence);
+        return;
+    }
 
     if (mModeSet) {
         mFlipPending = true;
-        if (drmModePageFlip(mDevice.fd(), mCrtc, fb.id(), DRM_MODE_PAGE_FLIP_EVENT, this)) {
-            PLOG(ERROR) << "Failed to perform page flip for display " << *this;
-            mFlipPending = false;
+        mFlipSequence = sequence;
+        mFlipFramebuffer = fb;
+        auto adopted = std::exchange(mAdopted, false);
+        if (!drmModePageFlip(mDevice.fd(), mCrtc, fb->id(), DRM_MODE_PAGE_FLIP_EVENT,
+                reinterpret_cast<void*>(uintptr_t{mEventToken})))
+            return;
+
+        PLOG(ERROR) << "Failed to perform page flip for display " << *this;
+        mFlipPending = false;
+        mFlipFramebuffer.reset();
+        if (!adopted) {
+            mTimeline.signal(sequence);
+            return;
         }
+
+        // The framebuffer might not be compatible with the one shown before (e.g. format)
+        LOG(INFO) << "Setting mode kept from before again for display " << *this;
+        mModeSet = false;
+    }
+
+    auto ret = modeSet(*fb);
+
+    // The mode set is synchronous, the frame is already visible (or failed)
+    mTimeline.signal(sequence);
+
+    if (!ret) {
+        PLOG(ERROR) << "Failed to enable CRTC " << mCrtc
+            << " for display " << *this;
     } else {
-        auto mode = &mModes[mCurrentMode];
-        if (drmModeSetCrtc(mDevice.fd(), mCrtc, fb.id(), 0, 0, &mConnector, 1, mode)) {
-            PLOG(ERROR) << "Failed to enable CRTC " << mCrtc
-                << " for display " << *this;
-        } else {
-            mModeSet = true;
-            if (mVsyncEnabled)
-                mVsyncThread.enable();
+        mFramebuffer = std::move(fb);
+        mModeSet = true;
+
+        // The timings have changed, fit the vsync model again
+        resetVsync();
+        updateVsync();
+        applyCursor();
+        applyColorTransform();
+    }
+}
+
+bool DrmDisplay::needsScaling(const DrmFramebuffer& fb) const {
+    if (mScalingBroken || !fb.width() || !fb.height() || mCurrentMode >= mModes.size())
+        return false;
+
+    auto& mode = mModes[mCurrentMode];
+    return fb.width() != mode.hdisplay || fb.height() != mode.vdisplay;
+}
+
+bool DrmDisplay::modeSet(const DrmFramebuffer& fb) {
+    auto& mode = mModes[mCurrentMode];
+    if (needsScaling(fb)) {
+        // Dumb buffers are cleared when allocated, so the background is black
+        if (!mBackground || mBackground->width() != mode.hdisplay
+                || mBackground->height() != mode.vdisplay)
+            mBackground = std::make_unique<DrmFramebuffer>(mDevice, mode.hdisplay, mode.vdisplay);
+
+        if (!mBackground->id()) {
+            mScalingBroken = true;
+        } else if (drmModeSetCrtc(mDevice.fd(), mCrtc, mBackground->id(), 0, 0,
+                &mConnector, 1, &mode)) {
+            return false;
+        } else if (showScaled(fb)) {
+            return true;
+        }
+        LOG(WARNING) << "Showing frames of size " << fb.width() << "x" << fb.height()
+            << " unscaled on display " << *this;
+    }
+
+    disableOverlay();
+    mBackground.reset();
+    return !drmModeSetCrtc(mDevice.fd(), mCrtc, fb.id(), 0, 0, &mConnector, 1, &mode);
+}
+
+bool DrmDisplay::showScaled(const DrmFramebuffer& fb) {
+    auto plane = mDevice.overlayPlane(mPipe);
+    if (!plane) {
+        LOG(ERROR) << "No overlay plane available to scale frames for display " << *this;
+        mScalingBroken = true;
+        return false;
+    }
+
+    // Keep the aspect ratio (with black bars at the sides)
+    auto& mode = mModes[mCurrentMode];
+    uint32_t w = mode.hdisplay, h = mode.vdisplay;
+    if (uint64_t{fb.width()} * h > uint64_t{fb.height()} * w)
+        h = uint64_t{fb.height()} * w / fb.width();
+    else
+        w = uint64_t{fb.width()} * h / fb.height();
+
+    if (drmModeSetPlane(mDevice.fd(), plane, mCrtc, fb.id(), 0,
+            (mode.hdisplay - w) / 2, (mode.vdisplay - h) / 2, w, h,
+            0, 0, fb.width() << 16, fb.height() << 16)) {
+        PLOG(ERROR) << "Failed to scale frame using plane " << plane
+            << " for display " << *this;
+        mScalingBroken = true;
+        disableOverlay();
+        return false;
+    }
+
+    mOverlay = plane;
+    return true;
+}
+
+void DrmDisplay::disableOverlay() {
+    if (!mOverlay)
+        return;
+
+    if (drmModeSetPlane(mDevice.fd(), mOverlay, mCrtc, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0))
+        PLOG(ERROR) << "Failed to disable plane " << mOverlay << " of display " << *this;
+    mOverlay = 0;
+    mOverlayFramebuffer.reset();
+}
+
+bool DrmDisplay::setCursor(buffer_handle_t buffer, base::unique_fd acquireFence,
+        base::unique_fd* releaseFence) {
+    BufferInfo info;
+    if (!getBufferInfo(buffer, &info))
+        return false;
+
+    uint32_t sequence;
+    {
+        std::scoped_lock lock{mMutex};
+        sequence = ++mCursorSequence;
+    }
+
+    base::unique_fd fence{mCursorTimeline.createFence(sequence)};
+    base::unique_fd source{fcntl(info.fd, F_DUPFD_CLOEXEC, 0)};
+    if (fence < 0 || source < 0) {
+        // Without a release fence the buffer must be copied before returning
+        updateCursor(info, std::move(acquireFence), sequence);
+        return true;
+    }
+    info.fd = source;
+
+    // Waiting for the acquire fence and copying must not block the caller
+    *releaseFence = std::move(fence);
+    mCommitThread.queueCursor(std::move(source), info, std::move(acquireFence), sequence);
+    return true;
+}
+
+void DrmDisplay::updateCursor(const BufferInfo& info, base::unique_fd acquireFence,
+        uint32_t sequence) {
+    if (acquireFence >= 0 && sync_wait(acquireFence, CURSOR_FENCE_TIMEOUT)) {
+        PLOG(ERROR) << "Failed to wait for cursor buffer of display " << *this;
+    } else {
+        std::scoped_lock lock{mMutex};
+        // Skip if hidden or replaced in the meantime
+        if (sequence == mCursorSequence && mCursor.update(info)) {
+            mCursorVisible = true;
+            applyCursor();
         }
     }
+    releaseCursor(sequence);
+}
+
+void DrmDisplay::releaseCursor(uint32_t sequence) {
+    // Also releases all older buffers, which were replaced before they were copied
+    mCursorTimeline.signal(sequence);
+}
+
+void DrmDisplay::hideCursor() {
+    std::scoped_lock lock{mMutex};
+    ++mCursorSequence; // Drop a pending update
+    if (!mCursorVisible)
+        return;
+
+    mCursorVisible = false;
+    applyCursor();
+}
+
+void DrmDisplay::moveCursor(int32_t x, int32_t y) {
+    std::scoped_lock lock{mMutex};
+    mCursorX = x;
+    mCursorY = y;
+
+    if (mModeSet && mCursorVisible && drmModeMoveCursor(mDevice.fd(), mCrtc, x, y)) {
+        PLOG(ERROR) << "Failed to move cursor of display " << *this;
+    }
+}
+
+void DrmDisplay::applyCursor() {
+    if (!mModeSet)
+        return; // Applied after the next mode set
+
+    if (!mCursorVisible) {
+        drmModeSetCursor(mDevice.fd(), mCrtc, 0, 0, 0);
+        return;
+    }
+
+    // The hotspot is not needed, the position is always the top left corner
+    if (drmModeSetCursor2(mDevice.fd(), mCrtc, mCursor.handle(),
+                mCursor.width(), mCursor.height(), 0, 0)
+            && drmModeSetCursor(mDevice.fd(), mCrtc, mCursor.handle(),
+                mCursor.width(), mCursor.height())) {
+        PLOG(ERROR) << "Failed to set cursor of display " << *this;
+        return;
+    }
+
+    if (drmModeMoveCursor(mDevice.fd(), mCrtc, mCursorX, mCursorY)) {
+        PLOG(ERROR) << "Failed to move cursor of display " << *this;
+    }
 }
 
 std::ostream& operator<<(std::ostream& os, const DrmDisplay& display) {
-    return os << display.mConnector << " (" << display.mName << ")";
+    return os << display.mId << " (" << display.mName << ")";
 }
 
 }  // namespace drmfb
@@ -3,13 +3,21 @@
 
 #pragma once
 
+#include <array>
+#include <atomic>
+#include <condition_variable>
 #include <cstdint>
+#include <memory>
+#include <mutex>
 #include <vector>
-#include <unordered_map>
 #include <iostream>
 #include <xf86drmMode.h>
+#include <android-base/unique_fd.h>
+#include "DrmCommitThread.h"
+#include "DrmCursor.h"
 #include "DrmFramebuffer.h"
-#include "DrmVsyncThread.h"
+#include "DrmVsyncModel.h"
+#include "SyncTimeline.h"
 
 namespace android {
 namespace hardware {
@@ -19,22 +27,27 @@ namespace V2_1 {
 namespace drmfb {
 
 struct DrmDevice;
+struct SoftwareFrame;
 
 struct DrmDisplay {
     DrmDisplay(DrmDevice &device, uint32_t connectorId);
     ~DrmDisplay();
 
     inline DrmDevice& device() const { return mDevice; }
-    inline uint32_t id() const { return mConnector; }
+    inline uint64_t id() const { return mId; } // Unique across all devices
+    inline uint32_t connector() const { return mConnector; }
+    inline uint32_t eventToken() const { return mEventToken; }
     inline unsigned pipe() const { return mPipe; }
     inline const std::string& name() const { return mName; }
     inline unsigned modeCount() const { return mModes.size(); }
     inline unsigned currentMode() const { return mCurrentMode; }
     inline bool connected() const { return mConnected; }
     inline bool enabled() const { return !!mCrtc; }
-    inline bool internal() const {
-        return mType == DRM_MODE_CONNECTOR_LVDS || mType == DRM_MODE_CONNECTOR_eDP
-            || mType == DRM_MODE_CONNECTOR_VIRTUAL || mType == DRM_MODE_CONNECTOR_DSI;
+    inline const DrmCommitThread& commitThread() const { return mCommitThread; }
+    inline bool internal() const { return internal(mType); }
+    static inline bool internal(uint32_t type) {
+        return type == DRM_MODE_CONNECTOR_LVDS || type == DRM_MODE_CONNECTOR_eDP
+            || type == DRM_MODE_CONNECTOR_VIRTUAL || type == DRM_MODE_CONNECTOR_DSI;
     }
 
     int32_t width(unsigned mode) const;
@@ -44,49 +57,201 @@ struct DrmDisplay {
     int32_t dpiY(unsigned mode) const;
 
     bool setMode(unsigned mode);
+    /*
+     * A mode with the size (e.g. of a mirrored display) and preferably the
+     * same vsync period, otherwise the preferred one.
+     */
+    unsigned findMode(int32_t width, int32_t height, int32_t vsyncPeriod) const;
 
-    void update();
+    void update(bool probe = false); // Probe the connector even if nothing has changed
+    void remove(); // The connector was removed (e.g. DP MST)
     void report();
     void vsync(int64_t timestamp);
 
-    bool enable();
+    bool enable(); // Also turns the display on again after setDpms()
     void disable();
 
+    /*
+     * Turns the display off (or into a lower power state) using the DPMS
+     * property of the connector. The CRTC, mode and framebuffers are kept,
+     * so enable() only needs to turn it on again. Returns false if this is
+     * not possible (e.g. the display is not enabled).
+     */
+    bool setDpms(uint64_t dpms);
+
+    // Same as enabled(), but for callers that do not hold the lock of the display
+    bool hasCrtc() const;
+    // Whether the display should get a CRTC with planes (e.g. it used the cursor)
+    bool needsPlanes() const;
+    // The CRTC that already displays the current mode (e.g. set by the bootloader)
+    uint32_t preferredCrtc() const;
+    // Called by the device when a CRTC is assigned (or moved to another one)
+    void setCrtc(unsigned pipe, uint32_t crtc, bool move);
+
     void enableVsync();
     void disableVsync();
 
-    void present(buffer_handle_t buffer);
-    void handlePageFlip();
+    /*
+     * Applies the color transform (4x4 row-major matrix, see HWC2) using
+     * the gamma LUT and the CTM of the CRTC, nullptr for the identity.
+     */
+    void setColorTransform(const float* matrix);
+    // Skip the color transform for the next presented frames (applied by the client)
+    void bypassColorTransform(bool bypass);
+    // Whether the matrix only scales and offsets each channel (no CTM needed)
+    static bool diagonalColorTransform(const float* matrix);
+
+    // Called from the event thread
+    void handleVblank(int64_t timestamp);
+    void handleTimer();
+
+    inline bool presentFences() const { return mTimeline.valid(); }
+
+    base::unique_fd present(buffer_handle_t buffer, base::unique_fd acquireFence,
+                            bool damaged = true);
+    // frame is rendered into the framebuffer on the commit thread, if set.
+    // With replace, a full queue drops its last frame instead of blocking.
+    base::unique_fd present(std::shared_ptr<const DrmFramebuffer> fb,
+                            base::unique_fd acquireFence, bool damaged = true,
+                            std::shared_ptr<SoftwareFrame> frame = nullptr,
+                            bool replace = false);
+    // Called on the commit thread
+    void commit(std::shared_ptr<const DrmFramebuffer> fb, uint32_t sequence, bool damaged,
+                bool bypassColorTransform);
+    void handlePageFlip(int64_t timestamp); // Called from the event thread
+
+    // Whether the buffer can be presented directly (it must cover the whole display)
+    bool supportsScanout(buffer_handle_t buffer) const;
+
+    inline bool supportsCursor(buffer_handle_t buffer) const { return mCursor.supports(buffer); }
+    // The release fence signals once the buffer was copied (-1 if copied immediately)
+    bool setCursor(buffer_handle_t buffer, base::unique_fd acquireFence,
+                   base::unique_fd* releaseFence);
+    // Called by the commit thread, waits for the acquire fence and copies the cursor
+    void updateCursor(const BufferInfo& info, base::unique_fd acquireFence, uint32_t sequence);
+    // Signals the release fence of a cursor buffer that will not be copied
+    void releaseCursor(uint32_t sequence);
+    void hideCursor();
+    void moveCursor(int32_t x, int32_t y);
 
     friend std::ostream& operator<<(std::ostream& os, const DrmDisplay& display);
 
 private:
+    void connect(const drmModeConnector& connector);
+    void disconnect();
+    bool sameModes(const drmModeConnector& connector) const; // As reported on connect
     void setModes(const drmModeModeInfo* begin, const drmModeModeInfo* end);
-    void awaitPageFlip() const;
+    void awaitPageFlip(std::unique_lock<std::mutex>& lock);
+    void signalPresented();
+    void signalOnVblank(uint32_t sequence);
+    int64_t period() const;
+    void resetVsync();
+    void updateVsync();
+    void requestVblank();
+    void scheduleVsync();
+    void cancelVsyncTimer();
+    bool reportVsync(int64_t timestamp);
+    void releaseFramebuffers();
+    void applyCursor();
+    bool needsScaling(const DrmFramebuffer& fb) const;
+    bool modeSet(const DrmFramebuffer& fb);
+    bool showScaled(const DrmFramebuffer& fb);
+    void disableOverlay();
+    void applyColorTransform();
+    void resume();
+    void findBootMode(const drmModeConnector& connector);
+    bool adoptBootMode();
 
     DrmDevice& mDevice;
     uint32_t mConnector;
+    uint64_t mId;
+    // Identifies the display in DRM events, unlike connector IDs (e.g. of MST) never reused
+    const uint32_t mEventToken;
+
+    // Held by update() and remove(), e.g. the startup probe and the hotplug thread
+    std::mutex mUpdateMutex;
+
+    /*
+     * Protects the display state below. It must not be held while waiting
+     * for the commit thread (it is released while waiting for page flips).
+     * Each display has its own lock, so displays never wait for each other.
+     */
+    mutable std::mutex mMutex;
 
     std::string mName;
     uint32_t mType;
 
     // Updated on each hotplug (disconnect and re-connect)
     uint32_t mmWidth, mmHeight;
+    std::vector<uint8_t> mEdid; // To detect if the display was replaced
     std::vector<drmModeModeInfo> mModes;
+    std::vector<drmModeModeInfo> mConnectorModes; // Unfiltered, to detect changes
     unsigned mCurrentMode;
 
     uint32_t mCrtc = 0; // Selected when display is powered on
     unsigned mPipe;
 
-    bool mConnected = false;
+    /*
+     * The CRTC that already had the mode of the display when it was connected
+     * (e.g. programmed by the bootloader, fbcon or the previous HAL instance).
+     * It is kept if possible, so the first frame only needs a page flip.
+     */
+    uint32_t mBootCrtc = 0;
+    bool mAdopted = false; // Mode set fallback if the first page flip fails
+
+    std::atomic<bool> mConnected{false};
     bool mModeSet = false;
+    uint32_t mDpmsProperty = 0; // 0 if not available
+    uint64_t mDpms = DRM_MODE_DPMS_ON; // Frames are only committed if on
     bool mFlipPending = false;
+    std::condition_variable mFlipCondition;
+
     bool mVsyncEnabled = false;
+    bool mVblankPending = false; // Waiting for vblank event
+    bool mVblankBroken = false; // drmWaitVBlank failed, only use the model
+    int64_t mVsyncTimestamp = 0; // Last reported vsync
+    int64_t mVsyncTarget = 0; // Predicted vsync the timer is scheduled for
+    int64_t mLastSample = 0; // Last hardware timestamp (vblank or page flip)
+    DrmVsyncModel mVsyncModel;
+    base::unique_fd mVsyncTimer; // Reports predicted vsync once the model is locked
+
+    // Kept to avoid removing them from the framebuffer cache while in use
+    std::shared_ptr<const DrmFramebuffer> mFramebuffer; // Currently displayed
+    std::shared_ptr<const DrmFramebuffer> mFlipFramebuffer; // Pending page flip
+
+    /*
+     * Frames of a different size (e.g. when mirroring another display) are
+     * scaled using an overlay plane, on top of a black primary plane.
+     */
+    uint32_t mOverlay = 0; // Plane showing the scaled frame, 0 if not in use
+    bool mScalingBroken = false; // Show frames unscaled (until reconnected)
+    std::unique_ptr<DrmFramebuffer> mBackground;
+    std::shared_ptr<const DrmFramebuffer> mOverlayFramebuffer; // Replaced, until next vblank
+
+    /*
+     * Present fences are created on the timeline with an increasing sequence
+     * and signaled once the page flip for the frame has completed.
+     */
+    SyncTimeline mTimeline;
+    uint32_t mSequence = 0; // Sequence of the last presented frame
+    uint32_t mFlipSequence = 0; // Sequence of the pending page flip
+    uint32_t mVblankSequence = 0; // Sequence of an unchanged frame (no page flip)
+    bool mSignalOnVblank = false;
+
+    // Restored after each mode set (the CRTC might have been used by another display)
+    std::array<float, 16> mColorTransform;
+    bool mColorTransformIdentity = true;
+    bool mColorTransformBypass = false; // For the next presented frames
+    bool mColorTransformBypassed = false; // For the displayed frame
 
-    // TODO: Clean up framebuffers
-    std::unordered_map<buffer_handle_t, DrmFramebuffer> mFramebuffers;
+    // Restored after each mode set
+    DrmCursor mCursor;
+    bool mCursorVisible = false;
+    uint32_t mCursorSequence = 0; // Incremented for each change of the cursor buffer
+    SyncTimeline mCursorTimeline; // Release fences of cursor buffers, by sequence
+    int32_t mCursorX = 0, mCursorY = 0;
 
-    DrmVsyncThread mVsyncThread;
+    DrmCommitThread mCommitThread;
 };
 
 std::ostream& operator<<(std::ostream& os, const DrmDisplay& display);
@@ -0,0 +1,222 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (C) 2019 Stephan Gerhold
+
+#define LOG_TAG "drmfb-event"
+
+#include <cstdlib>
+#include <cstring>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <cutils/uevent.h>
+#include <android-base/logging.h>
+#include <xf86drm.h>
+#include "DrmEventThread.h"
+#include "DrmDevice.h"
+
+namespace android {
+namespace hardware {
+namespace graphics {
+namespace composer {
+namespace V2_1 {
+namespace drmfb {
+
+namespace {
+constexpr int MAX_EVENTS = 8;
+constexpr int RECEIVE_BUFFER = 1 * 1024 * 1024; // 1 MiB
+constexpr int MESSAGE_BUFFER = 1 * 1024; // 1 KiB
+constexpr int64_t NANO = 1'000'000'000;
+
+constexpr int64_t timestamp(unsigned int sec, unsigned int usec) {
+    return sec * NANO + usec * 1000;
+}
+
+// The device of the event thread, the event handlers have no other context
+thread_local DrmDevice* eventDevice = nullptr;
+
+/*
+ * Displays may be removed at any time, so events only contain their token.
+ * Events of a removed display are dropped, even if its connector ID was
+ * already reused for another display (e.g. by DP MST).
+ */
+std::shared_ptr<DrmDisplay> getDisplay(void* user_data) {
+    return eventDevice->getEventDisplay(
+        static_cast<uint32_t>(reinterpret_cast<uintptr_t>(user_data)));
+}
+
+void handleVblank(int /*fd*/, unsigned int /*sequence*/,
+        unsigned int tv_sec, unsigned int tv_usec, void* user_data) {
+    eventDevice->events().recordWakeup(timestamp(tv_sec, tv_usec));
+    if (auto display = getDisplay(user_data))
+        display->handleVblank(timestamp(tv_sec, tv_usec));
+}
+
+void handlePageFlip(int /*fd*/, unsigned int /*sequence*/,
+        unsigned int tv_sec, unsigned int tv_usec, void* user_data) {
+    eventDevice->events().recordWakeup(timestamp(tv_sec, tv_usec));
+    if (auto display = getDisplay(user_data))
+        display->handlePageFlip(timestamp(tv_sec, tv_usec));
+}
+
+drmEventContext eventContext = {
+    .version = DRM_EVENT_CONTEXT_VERSION,
+    .vblank_handler = handleVblank,
+    .page_flip_handler = handlePageFlip,
+};
+}
+
+DrmEventThread::DrmEventThread(DrmDevice& device)
+    : GraphicsThread("drm-event", ThreadClass::EVENT), mDevice(device),
+      mEpoll(epoll_create1(EPOLL_CLOEXEC)),
+      mWake(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)),
+      mUevent(uevent_open_socket(RECEIVE_BUFFER, true)) {
+    if (mEpoll < 0)
+        PLOG(ERROR) << "Failed to create epoll instance";
+    if (mWake < 0)
+        PLOG(ERROR) << "Failed to create eventfd";
+    if (mUevent < 0)
+        PLOG(ERROR) << "Failed to open uevent socket";
+
+    add(mWake);
+    add(mUevent);
+    add(mDevice.fd());
+}
+
+DrmEventThread::~DrmEventThread() {
+    // Stop here, wake() cannot be called anymore from the base destructor
+    stop();
+}
+
+bool DrmEventThread::add(int fd) {
+    if (mEpoll < 0 || fd < 0)
+        return false;
+
+    epoll_event event{ .events = EPOLLIN, .data = { .fd = fd }};
+    if (epoll_ctl(mEpoll, EPOLL_CTL_ADD, fd, &event)) {
+        PLOG(ERROR) << "Failed to add fd " << fd << " to epoll";
+        return false;
+    }
+    return true;
+}
+
+void DrmEventThread::addTimer(int fd, uint32_t token) {
+    {
+        std::scoped_lock lock{mTimersMutex};
+        mTimers[fd] = token;
+    }
+    add(fd);
+}
+
+void DrmEventThread::removeTimer(int fd) {
+    if (mEpoll >= 0)
+        epoll_ctl(mEpoll, EPOLL_CTL_DEL, fd, nullptr);
+
+    std::scoped_lock lock{mTimersMutex};
+    mTimers.erase(fd);
+}
+
+void DrmEventThread::wake() {
+    uint64_t value = 1;
+    if (write(mWake, &value, sizeof(value)) < 0)
+        PLOG(ERROR) << "Failed to wake event thread";
+}
+
+void DrmEventThread::work(std::unique_lock<std::mutex>& lock) {
+    eventDevice = &mDevice;
+    loop(lock, [this] {
+        epoll_event events[MAX_EVENTS];
+        auto n = epoll_wait(mEpoll, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno != EINTR)
+                PLOG(ERROR) << "Failed to wait for events";
+            return;
+        }
+
+        for (auto i = 0; i < n; ++i) {
+            dispatch(events[i].data.fd);
+        }
+    });
+}
+
+void DrmEventThread::dispatch(int fd) {
+    if (fd == mDevice.fd()) {
+        handleDrmEvent();
+    } else if (fd == mUevent) {
+        uint32_t connector;
+        if (receiveUevent(&connector))
+            mDevice.hotplug(connector);
+    } else if (fd == mWake) {
+        uint64_t value;
+        read(mWake, &value, sizeof(value));
+    } else {
+        uint32_t token = 0;
+        {
+            std::scoped_lock lock{mTimersMutex};
+            if (auto i = mTimers.find(fd); i != mTimers.end())
+                token = i->second;
+        }
+
+        if (auto display = token ? mDevice.getEventDisplay(token) : nullptr)
+            display->handleTimer();
+    }
+}
+
+void DrmEventThread::handleDrmEvent() {
+    if (drmHandleEvent(mDevice.fd(), &eventContext)) {
+        PLOG(ERROR) << "Failed to handle DRM event";
+    }
+}
+
+bool DrmEventThread::receiveUevent(uint32_t* connector) {
+    char msg[MESSAGE_BUFFER];
+    auto n = uevent_kernel_multicast_recv(mUevent, msg, sizeof(msg));
+    if (n <= 0)
+        return false;
+
+    bool drm = false;
+    bool hotplug = false;
+    uint32_t property = 0;
+    int devMinor = -1;
+    *connector = 0;
+    for (auto buf = msg, end = msg + n; buf < end; buf += strlen(buf) + 1) {
+        if (!strcmp(buf, "DEVTYPE=drm_minor"))
+            drm = true;
+        else if (!strcmp(buf, "HOTPLUG=1"))
+            hotplug = true;
+        else if (!strncmp(buf, "CONNECTOR=", strlen("CONNECTOR=")))
+            *connector = strtoul(buf + strlen("CONNECTOR="), nullptr, 10);
+        else if (!strncmp(buf, "PROPERTY=", strlen("PROPERTY=")))
+            property = strtoul(buf + strlen("PROPERTY="), nullptr, 10);
+        else if (!strncmp(buf, "MINOR=", strlen("MINOR=")))
+            devMinor = atoi(buf + strlen("MINOR="));
+    }
+
+    if (!drm || !hotplug)
+        return false;
+
+    // The uevents of all DRM devices are received, connector IDs are per device
+    struct stat st;
+    if (devMinor >= 0 && !fstat(mDevice.fd(), &st) && devMinor != static_cast<int>(minor(st.st_rdev)))
+        return false;
+
+    // Newer kernels (4.19+) report the connector that has changed (or its property)
+    if (property) {
+        // e.g. link-status or content protection, the connection did not change
+        LOG(DEBUG) << "Ignoring uevent for property " << property << " of connector "
+            << *connector;
+        return false;
+    }
+    if (*connector)
+        LOG(DEBUG) << "Received hotplug uevent for connector " << *connector;
+    else
+        LOG(DEBUG) << "Received hotplug uevent";
+    return true;
+}
+
+}  // namespace drmfb
+}  // namespace V2_1
+}  // namespace composer
+}  // namespace graphics
+}  // namespace hardware
+}  // namespace android
@@ -0,0 +1,60 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (C) 2019 Stephan Gerhold
+
+#pragma once
+
+#include <unordered_map>
+#include <android-base/unique_fd.h>
+#include "GraphicsThread.h"
+
+namespace android {
+namespace hardware {
+namespace graphics {
+namespace composer {
+namespace V2_1 {
+namespace drmfb {
+
+struct DrmDevice;
+struct DrmDisplay;
+
+/*
+ * Waits for all events of a DRM device in a single thread (using epoll):
+ *   - DRM events (page flips and vblanks), dispatched to the display
+ *   - Hotplug uevents, dispatched to the device
+ *   - Timers of the displays
+ *
+ * This is the only thread that handles DRM events of the device.
+ */
+struct DrmEventThread : public GraphicsThread {
+    DrmEventThread(DrmDevice& device);
+    ~DrmEventThread();
+
+    void addTimer(int fd, uint32_t token); // Dispatched to the display with the event token
+    void removeTimer(int fd);
+
+protected:
+    void work(std::unique_lock<std::mutex>& lock) override;
+    void wake() override;
+
+private:
+    bool add(int fd);
+    void dispatch(int fd);
+    void handleDrmEvent();
+    bool receiveUevent(uint32_t* connector); // connector is 0 if unknown
+
+    DrmDevice& mDevice;
+
+    base::unique_fd mEpoll;
+    base::unique_fd mWake;
+    base::unique_fd mUevent;
+
+    std::mutex mTimersMutex;
+    std::unordered_map<int, uint32_t> mTimers; // fd -> event token of the display
+};
+
+}  // namespace drmfb
+}  // namespace V2_1
+}  // namespace composer
+}  // namespace graphics
+}  // namespace hardware
+}  // namespace android
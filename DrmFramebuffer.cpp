@@ -3,7 +3,16 @@
 
 #define LOG_TAG "drmfb-framebuffer"
 
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <android-base/logging.h>
+#include <linux/dma-buf.h>
+#include <drm/drm_fourcc.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
 #include "DrmDevice.h"
 #include "DrmFramebuffer.h"
 #include "DrmFramebufferImporter.h"
@@ -17,25 +26,224 @@ namespace drmfb {
 
 namespace {
 // TODO: Add a proper importer interface
-uint32_t addFramebuffer(int fd, buffer_handle_t buffer) {
+uint32_t addFramebuffer(DrmGemHandleTable& gem, buffer_handle_t buffer, GemHandles* handles) {
     uint32_t id = 0;
-    if (libdrm::addFramebuffer(fd, buffer, &id))
+    if (libdrm::addFramebuffer(gem, buffer, &id, handles))
         return id;
-    if (minigbm::addFramebuffer(fd, buffer, &id))
+    if (minigbm::addFramebuffer(gem, buffer, &id, handles))
         return id;
 
     LOG(ERROR) << "No importer available for buffer with "
         << buffer->numFds << " FDs and " << buffer->numInts << " ints";
     return 0;
 }
+
+void syncBuffer(int fd, uint64_t flags) {
+    // Not supported by older kernels, but still worth trying
+    dma_buf_sync sync{ .flags = flags };
+    ioctl(fd, DMA_BUF_IOCTL_SYNC, &sync);
+}
+
+// Buffers that can be copied row by row into a (32 bpp) dumb buffer
+bool supportsCopy(const BufferInfo& info) {
+    // Tiled or compressed layouts cannot be copied like this
+    if (info.modifier != DRM_FORMAT_MOD_LINEAR && info.modifier != DRM_FORMAT_MOD_INVALID)
+        return false;
+
+    switch (info.format) {
+    case DRM_FORMAT_ARGB8888:
+    case DRM_FORMAT_XRGB8888:
+    case DRM_FORMAT_ABGR8888:
+    case DRM_FORMAT_XBGR8888:
+        return true;
+    default:
+        return false;
+    }
+}
+}
+
+bool getBufferInfo(buffer_handle_t buffer, BufferInfo* info) {
+    return libdrm::getBufferInfo(buffer, info)
+        || minigbm::getBufferInfo(buffer, info);
+}
+
+bool supportsScanout(const BufferInfo& info) {
+    switch (info.format) {
+    case DRM_FORMAT_ARGB8888:
+    case DRM_FORMAT_XRGB8888:
+    case DRM_FORMAT_ABGR8888:
+    case DRM_FORMAT_XBGR8888:
+    case DRM_FORMAT_BGR888:
+    case DRM_FORMAT_BGR565:
+    case DRM_FORMAT_RGB565:
+        return true;
+    default:
+        return false; // e.g. YUV formats that are not supported on primary planes
+    }
 }
 
-DrmFramebuffer::DrmFramebuffer(const DrmDevice& device, buffer_handle_t buffer)
-    : mDevice(device), mId(addFramebuffer(device.fd(), buffer)) {}
+bool sameBuffer(DrmGemHandleTable& gem, buffer_handle_t a, buffer_handle_t b) {
+    if (a == b)
+        return true;
+
+    BufferInfo infoA, infoB;
+    if (!a || !b || !getBufferInfo(a, &infoA) || !getBufferInfo(b, &infoB)
+            || infoA.offset != infoB.offset)
+        return false;
+
+    /*
+     * Importing the same dma-buf always returns the same GEM handle.
+     * (Before Linux 5.1, all dma-bufs share a single inode, so they cannot
+     * be compared using fstat().)
+     */
+    uint32_t handleA, handleB;
+    if (!gem.import(infoA.fd, &handleA))
+        return false;
+    auto same = gem.import(infoB.fd, &handleB);
+    if (same) {
+        same = handleA == handleB;
+        gem.release(handleB);
+    }
+    gem.release(handleA);
+    return same;
+}
+
+DrmFramebuffer::DrmFramebuffer(DrmDevice& device, buffer_handle_t buffer)
+    : mDevice(device) {
+    BufferInfo info;
+    auto hasInfo = getBufferInfo(buffer, &info);
+    if (hasInfo) {
+        mWidth = info.width;
+        mHeight = info.height;
+    }
+
+    mId = addFramebuffer(device.gemHandles(), buffer, &mHandles);
+    if (!mId) {
+        // Release the GEM handles immediately if the import failed
+        releaseHandles();
+        if (!hasInfo || !addCopy(info))
+            return;
+        LOG(WARNING) << "Buffer cannot be imported into DRM device " << device.index()
+            << ", falling back to copying it using the CPU";
+    }
+}
+
+DrmFramebuffer::DrmFramebuffer(DrmDevice& device, uint32_t width, uint32_t height)
+    : mDevice(device), mWidth(width), mHeight(height) {
+    if (!allocateDumb(width, height))
+        return;
+
+    uint32_t handles[4] = {mDumbHandle};
+    uint32_t pitches[4] = {mPitch};
+    uint32_t offsets[4] = {};
+    if (drmModeAddFB2(mDevice.fd(), width, height, DRM_FORMAT_XBGR8888,
+            handles, pitches, offsets, &mId, 0)) {
+        PLOG(ERROR) << "drmModeAddFB2 failed for dumb buffer";
+        mId = 0;
+    }
+}
 
 DrmFramebuffer::~DrmFramebuffer() {
     if (mId)
         drmModeRmFB(mDevice.fd(), mId);
+    releaseHandles();
+
+    if (mMap)
+        munmap(mMap, mSize);
+    if (mDumbHandle) {
+        drm_mode_destroy_dumb destroy{ .handle = mDumbHandle };
+        drmIoctl(mDevice.fd(), DRM_IOCTL_MODE_DESTROY_DUMB, &destroy);
+    }
+}
+
+bool DrmFramebuffer::allocateDumb(uint32_t width, uint32_t height) {
+    drm_mode_create_dumb create{ .height = height, .width = width, .bpp = 32 };
+    if (drmIoctl(mDevice.fd(), DRM_IOCTL_MODE_CREATE_DUMB, &create)) {
+        PLOG(ERROR) << "Failed to create dumb buffer (" << width << "x" << height << ")";
+        return false;
+    }
+    mDumbHandle = create.handle;
+    mPitch = create.pitch;
+    mSize = create.size;
+
+    drm_mode_map_dumb map{ .handle = mDumbHandle };
+    if (drmIoctl(mDevice.fd(), DRM_IOCTL_MODE_MAP_DUMB, &map)) {
+        PLOG(ERROR) << "Failed to map dumb buffer";
+        return false;
+    }
+
+    auto addr = mmap(nullptr, mSize, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     mDevice.fd(), map.offset);
+    if (addr == MAP_FAILED) {
+        PLOG(ERROR) << "Failed to mmap dumb buffer";
+        return false;
+    }
+
+    mMap = addr;
+    return true;
+}
+
+bool DrmFramebuffer::addCopy(const BufferInfo& info) {
+    if (!supportsCopy(info))
+        return false;
+
+    // The buffer handle might be freed before the framebuffer
+    mSource.reset(fcntl(info.fd, F_DUPFD_CLOEXEC, 0));
+    if (mSource < 0) {
+        PLOG(ERROR) << "Failed to duplicate dma-buf fd";
+        return false;
+    }
+    mSourceInfo = info;
+    mSourceInfo.fd = mSource;
+
+    if (!allocateDumb(info.width, info.height)) {
+        mSource.reset();
+        return false;
+    }
+
+    uint32_t handles[4] = {mDumbHandle};
+    uint32_t pitches[4] = {mPitch};
+    uint32_t offsets[4] = {};
+    if (drmModeAddFB2(mDevice.fd(), info.width, info.height, info.format,
+            handles, pitches, offsets, &mId, 0)) {
+        PLOG(ERROR) << "drmModeAddFB2 failed for copied buffer";
+        mId = 0;
+        mSource.reset();
+        return false;
+    }
+    return true;
+}
+
+void DrmFramebuffer::copy() const {
+    if (!needsCopy() || !mMap)
+        return;
+
+    const auto& info = mSourceInfo;
+    size_t size = info.offset + info.stride * info.height;
+    auto addr = mmap(nullptr, size, PROT_READ, MAP_SHARED, info.fd, 0);
+    if (addr == MAP_FAILED) {
+        PLOG(ERROR) << "Failed to mmap buffer for copying";
+        return;
+    }
+
+    syncBuffer(info.fd, DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ);
+    auto src = static_cast<const uint8_t*>(addr) + info.offset;
+    auto dst = static_cast<uint8_t*>(mMap);
+    auto row = std::min(info.stride, mPitch);
+    for (uint32_t y = 0; y < info.height; ++y)
+        memcpy(dst + y * mPitch, src + y * info.stride, row);
+    syncBuffer(info.fd, DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ);
+
+    munmap(addr, size);
+}
+
+void DrmFramebuffer::releaseHandles() {
+    for (auto& handle : mHandles) {
+        if (handle) {
+            mDevice.gemHandles().release(handle);
+            handle = 0;
+        }
+    }
 }
 
 }  // namespace drmfb
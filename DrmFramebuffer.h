@@ -4,7 +4,9 @@
 #pragma once
 
 #include <cstdint>
+#include <android-base/unique_fd.h>
 #include <cutils/native_handle.h>
+#include "DrmFramebufferImporter.h"
 
 namespace android {
 namespace hardware {
@@ -15,15 +17,53 @@ namespace drmfb {
 
 struct DrmDevice;
 
+// Returns the layout of the buffer (using the available importers)
+bool getBufferInfo(buffer_handle_t buffer, BufferInfo* info);
+// Whether the buffer can be displayed directly (without composition)
+bool supportsScanout(const BufferInfo& info);
+// Whether both handles refer to the same buffer (e.g. imported separately)
+bool sameBuffer(DrmGemHandleTable& gem, buffer_handle_t a, buffer_handle_t b);
+
 struct DrmFramebuffer {
-    DrmFramebuffer(const DrmDevice& device, buffer_handle_t buffer);
+    DrmFramebuffer(DrmDevice& device, buffer_handle_t buffer);
+    // Allocates a dumb buffer (XBGR8888) that is written using the CPU
+    DrmFramebuffer(DrmDevice& device, uint32_t width, uint32_t height);
     ~DrmFramebuffer();
 
     inline uint32_t id() const { return mId; }
+    inline uint32_t width() const { return mWidth; }
+    inline uint32_t height() const { return mHeight; }
+
+    /*
+     * Buffers that cannot be imported into the device (e.g. allocated for
+     * another GPU) are copied into a dumb buffer using the CPU instead.
+     * copy() must be called (after the acquire fence) before the buffer is shown.
+     */
+    inline bool needsCopy() const { return mSource.get() >= 0; }
+    void copy() const;
+
+    // Only available for dumb buffers
+    inline uint32_t* pixels() const { return static_cast<uint32_t*>(mMap); }
+    inline uint32_t pitch() const { return mPitch; } // In bytes
 
 private:
-    const DrmDevice& mDevice;
-    const uint32_t mId;
+    void releaseHandles();
+    bool allocateDumb(uint32_t width, uint32_t height);
+    bool addCopy(const BufferInfo& info);
+
+    DrmDevice& mDevice;
+    uint32_t mId = 0;
+    uint32_t mWidth = 0, mHeight = 0; // 0 if unknown
+    GemHandles mHandles = {};
+
+    uint32_t mDumbHandle = 0;
+    uint32_t mPitch = 0;
+    uint64_t mSize = 0;
+    void* mMap = nullptr;
+
+    // Source for copied buffers
+    base::unique_fd mSource;
+    BufferInfo mSourceInfo = {};
 };
 
 }  // namespace drmfb
@@ -0,0 +1,102 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (C) 2019 Stephan Gerhold
+
+#define LOG_TAG "drmfb-framebuffer-cache"
+
+#include <android-base/logging.h>
+#include <android-base/properties.h>
+#include "DrmDevice.h"
+#include "DrmFramebufferCache.h"
+
+namespace android {
+namespace hardware {
+namespace graphics {
+namespace composer {
+namespace V2_1 {
+namespace drmfb {
+
+namespace {
+constexpr size_t DEFAULT_CAPACITY = 16;
+}
+
+DrmFramebufferCache::DrmFramebufferCache(DrmDevice& device)
+    : mDevice(device),
+      mCapacity(base::GetUintProperty<size_t>("hwc.drm.fb_cache.size", DEFAULT_CAPACITY)) {}
+
+DrmFramebufferCache::~DrmFramebufferCache() {
+    std::scoped_lock lock{mMutex};
+    for (const auto& entry : mEntries)
+        mDevice.gemHandles().release(entry.key.handle);
+}
+
+std::shared_ptr<const DrmFramebuffer> DrmFramebufferCache::get(buffer_handle_t buffer) {
+    /*
+     * The first file descriptor of the buffer handle is the dma-buf.
+     * Importing the same dma-buf always returns the same GEM handle.
+     * (All dma-bufs share a single inode before Linux 5.1, so fstat() cannot
+     * be used to identify them.)
+     */
+    uint32_t handle;
+    if (buffer->numFds < 1 || !mDevice.gemHandles().import(buffer->data[0], &handle)) {
+        LOG(WARNING) << "Failed to identify buffer, cannot cache framebuffer";
+        return std::make_shared<DrmFramebuffer>(mDevice, buffer);
+    }
+
+    BufferInfo info;
+    Key key{handle, getBufferInfo(buffer, &info) ? info.offset : 0};
+
+    std::scoped_lock lock{mMutex};
+    if (auto i = mIndex.find(key); i != mIndex.end()) {
+        ++mHits;
+        mDevice.gemHandles().release(handle); // The entry holds a reference already
+        mEntries.splice(mEntries.begin(), mEntries, i->second);
+        return i->second->framebuffer;
+    }
+
+    ++mMisses;
+    auto fb = std::make_shared<DrmFramebuffer>(mDevice, buffer);
+    if (!fb->id()) {
+        // Not cached, the import is attempted again with the next frame
+        mDevice.gemHandles().release(handle);
+        return fb;
+    }
+
+    mEntries.push_front({key, fb});
+    mIndex.emplace(key, mEntries.begin());
+    evict(mCapacity);
+    return fb;
+}
+
+void DrmFramebufferCache::trim() {
+    std::scoped_lock lock{mMutex};
+    evict(0);
+}
+
+void DrmFramebufferCache::evict(size_t capacity) {
+    for (auto i = mEntries.end(); mEntries.size() > capacity && i != mEntries.begin();) {
+        --i;
+
+        // Framebuffers that are still in use (on screen or pending) are kept
+        if (i->framebuffer.use_count() > 1)
+            continue;
+
+        mIndex.erase(i->key);
+        mDevice.gemHandles().release(i->key.handle);
+        i = mEntries.erase(i);
+        ++mEvictions;
+    }
+}
+
+std::ostream& operator<<(std::ostream& os, const DrmFramebufferCache& cache) {
+    std::scoped_lock lock{cache.mMutex};
+    return os << cache.mEntries.size() << "/" << cache.mCapacity << " framebuffers, "
+        << cache.mHits << " hits, " << cache.mMisses << " misses, "
+        << cache.mEvictions << " evictions";
+}
+
+}  // namespace drmfb
+}  // namespace V2_1
+}  // namespace composer
+}  // namespace graphics
+}  // namespace hardware
+}  // namespace android
@@ -0,0 +1,81 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (C) 2019 Stephan Gerhold
+
+#pragma once
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <unordered_map>
+#include "DrmFramebuffer.h"
+
+namespace android {
+namespace hardware {
+namespace graphics {
+namespace composer {
+namespace V2_1 {
+namespace drmfb {
+
+struct DrmDevice;
+
+/*
+ * Caches imported framebuffers for all displays of a device.
+ *
+ * Buffers are identified by the GEM handle of their (first) dma-buf instead
+ * of the buffer handle, because buffer handles may be freed and re-used
+ * for a different buffer. Each entry holds a reference to its GEM handle,
+ * so the handle cannot be re-used for another buffer while it is cached.
+ * The least recently used framebuffers are removed once the cache is full,
+ * unless they are still in use by a display.
+ */
+struct DrmFramebufferCache {
+    DrmFramebufferCache(DrmDevice& device);
+    ~DrmFramebufferCache();
+
+    std::shared_ptr<const DrmFramebuffer> get(buffer_handle_t buffer);
+    void trim(); // Remove all framebuffers that are not in use
+
+    friend std::ostream& operator<<(std::ostream& os, const DrmFramebufferCache& cache);
+
+private:
+    struct Key {
+        uint32_t handle; // GEM handle
+        uint32_t offset; // Of the first plane (e.g. for sub-allocated buffers)
+
+        inline bool operator==(const Key& other) const {
+            return handle == other.handle && offset == other.offset;
+        }
+    };
+    struct KeyHash {
+        inline size_t operator()(const Key& key) const {
+            return std::hash<uint64_t>{}(uint64_t{key.offset} << 32 | key.handle);
+        }
+    };
+    struct Entry {
+        Key key;
+        std::shared_ptr<DrmFramebuffer> framebuffer;
+    };
+
+    void evict(size_t capacity);
+
+    DrmDevice& mDevice;
+    const size_t mCapacity;
+
+    mutable std::mutex mMutex;
+    std::list<Entry> mEntries; // Most recently used first
+    std::unordered_map<Key, std::list<Entry>::iterator, KeyHash> mIndex;
+
+    uint64_t mHits = 0;
+    uint64_t mMisses = 0;
+    uint64_t mEvictions = 0;
+};
+
+std::ostream& operator<<(std::ostream& os, const DrmFramebufferCache& cache);
+
+}  // namespace drmfb
+}  // namespace V2_1
+}  // namespace composer
+}  // namespace graphics
+}  // namespace hardware
+}  // namespace android
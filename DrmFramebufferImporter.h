@@ -3,6 +3,7 @@
 
 #pragma once
 
+#include <array>
 #include <cstdint>
 
 namespace android {
@@ -12,15 +13,40 @@ namespace composer {
 namespace V2_1 {
 namespace drmfb {
 
+struct DrmGemHandleTable;
+
+/*
+ * The GEM handles imported for a framebuffer (one per plane).
+ * They are released (using the DrmGemHandleTable) by the DrmFramebuffer.
+ */
+using GemHandles = std::array<uint32_t, 4>;
+
+// Layout of the first plane of a buffer (e.g. to access it using the CPU)
+struct BufferInfo {
+    int fd; // dma-buf
+    uint32_t width, height;
+    uint32_t format; // DRM fourcc (including alpha)
+    uint32_t stride, offset; // In bytes
+    uint64_t modifier; // DRM_FORMAT_MOD_INVALID if unknown (assumed to be linear)
+};
+
 namespace libdrm {
-    bool addFramebuffer(int fd, buffer_handle_t buffer, uint32_t* id);
+    bool addFramebuffer(DrmGemHandleTable& gem, buffer_handle_t buffer,
+                        uint32_t* id, GemHandles* handles);
+    bool getBufferInfo(buffer_handle_t buffer, BufferInfo* info);
 }
 
 namespace minigbm {
 #ifdef USE_MINIGBM
-    bool addFramebuffer(int fd, buffer_handle_t buffer, uint32_t* id);
+    bool addFramebuffer(DrmGemHandleTable& gem, buffer_handle_t buffer,
+                        uint32_t* id, GemHandles* handles);
+    bool getBufferInfo(buffer_handle_t buffer, BufferInfo* info);
 #else
-    constexpr bool addFramebuffer(int, buffer_handle_t, uint32_t*) {
+    constexpr bool addFramebuffer(DrmGemHandleTable&, buffer_handle_t,
+                                  uint32_t*, GemHandles*) {
+        return false;
+    }
+    constexpr bool getBufferInfo(buffer_handle_t, BufferInfo*) {
         return false;
     }
 #endif
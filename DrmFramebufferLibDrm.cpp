@@ -11,6 +11,7 @@
 
 #include <android/gralloc_handle.h>
 #include "DrmFramebufferImporter.h"
+#include "DrmGemHandleTable.h"
 
 namespace android {
 namespace hardware {
@@ -40,31 +41,53 @@ static uint32_t convertAndroidToDrmFbFormat(uint32_t format) {
     }
 }
 
-void addFramebuffer(int fd, struct gralloc_handle_t* handle, uint32_t* id) {
-    uint32_t handles[4] = {};
+// Same as above, but keeps the alpha bits
+static uint32_t convertAndroidToDrmFormat(uint32_t format) {
+    switch (format) {
+    case HAL_PIXEL_FORMAT_RGBA_8888:
+        return DRM_FORMAT_ABGR8888;
+    case HAL_PIXEL_FORMAT_RGBX_8888:
+        return DRM_FORMAT_XBGR8888;
+    case HAL_PIXEL_FORMAT_RGB_888:
+        return DRM_FORMAT_BGR888;
+    case HAL_PIXEL_FORMAT_RGB_565:
+        return DRM_FORMAT_BGR565;
+    case HAL_PIXEL_FORMAT_BGRA_8888:
+        return DRM_FORMAT_ARGB8888;
+    default:
+        return 0;
+    }
+}
+
+void addFramebuffer(DrmGemHandleTable& gem, struct gralloc_handle_t* handle,
+        uint32_t* id, GemHandles* handles) {
     uint32_t pitches[4] = {handle->stride};
     uint32_t offsets[4] = {};
 
-    if (drmPrimeFDToHandle(fd, handle->prime_fd, &handles[0])) {
-        PLOG(ERROR) << "Failed to get handle for prime fd " << handle->prime_fd;
+    if (!gem.import(handle->prime_fd, &(*handles)[0]))
         return;
-    }
 
-    if (drmModeAddFB2(fd, handle->width, handle->height,
+    if (drmModeAddFB2(gem.fd(), handle->width, handle->height,
             convertAndroidToDrmFbFormat(handle->format),
-            handles, pitches, offsets, id, 0)) {
+            handles->data(), pitches, offsets, id, 0)) {
         PLOG(ERROR) << "drmModeAddFB2 failed";
     }
 }
-}
 
-bool addFramebuffer(int fd, buffer_handle_t buffer, uint32_t* id) {
+struct gralloc_handle_t* getHandle(buffer_handle_t buffer) {
     if (buffer->numFds != GRALLOC_HANDLE_NUM_FDS
             || buffer->numInts < static_cast<int>(GRALLOC_HANDLE_NUM_INTS))
-        return false;
+        return nullptr;
 
     auto handle = gralloc_handle(buffer);
-    if (handle->magic != GRALLOC_HANDLE_MAGIC)
+    return handle->magic == GRALLOC_HANDLE_MAGIC ? handle : nullptr;
+}
+}
+
+bool addFramebuffer(DrmGemHandleTable& gem, buffer_handle_t buffer,
+        uint32_t* id, GemHandles* handles) {
+    auto handle = getHandle(buffer);
+    if (!handle)
         return false;
 
     if (handle->version != GRALLOC_HANDLE_VERSION) {
@@ -73,7 +96,24 @@ bool addFramebuffer(int fd, buffer_handle_t buffer, uint32_t* id) {
         return true;
     }
 
-    addFramebuffer(fd, handle, id);
+    addFramebuffer(gem, handle, id, handles);
+    return true;
+}
+
+bool getBufferInfo(buffer_handle_t buffer, BufferInfo* info) {
+    auto handle = getHandle(buffer);
+    if (!handle || handle->version != GRALLOC_HANDLE_VERSION)
+        return false;
+
+    *info = {
+        .fd = handle->prime_fd,
+        .width = handle->width,
+        .height = handle->height,
+        .format = convertAndroidToDrmFormat(handle->format),
+        .stride = handle->stride,
+        .offset = 0,
+        .modifier = handle->modifier,
+    };
     return true;
 }
 
@@ -11,6 +11,7 @@
 #include <cros_gralloc_handle.h>
 #include <cros_gralloc_helpers.h>
 #include "DrmFramebufferImporter.h"
+#include "DrmGemHandleTable.h"
 
 namespace android {
 namespace hardware {
@@ -21,12 +22,13 @@ namespace drmfb {
 namespace minigbm {
 
 namespace {
-void addFramebuffer(int fd, cros_gralloc_handle_t handle, int planes, uint32_t* id) {
-    uint32_t handles[DRV_MAX_PLANES] = {};
-    for (int i = 0; i < planes; ++i) {
-        if (drmPrimeFDToHandle(fd, handle->fds[i], &handles[i])) {
-            PLOG(ERROR) << "Failed to get handle for prime fd "
-                << handle->fds[i] << " (plane " << i << ")";
+static_assert(DRV_MAX_PLANES <= std::tuple_size<GemHandles>::value);
+
+void addFramebuffer(DrmGemHandleTable& gem, cros_gralloc_handle_t handle, int planes,
+        uint32_t* id, GemHandles* handles) {
+    for (int i = 0; i < planes && i < static_cast<int>(handles->size()); ++i) {
+        if (!gem.import(handle->fds[i], &(*handles)[i])) {
+            LOG(ERROR) << "Failed to import plane " << i;
             return;
         }
     }
@@ -40,25 +42,50 @@ void addFramebuffer(int fd, cros_gralloc_handle_t handle, int planes, uint32_t*
         format = DRM_FORMAT_XBGR8888;
 
     // TODO: Consider using drmModeAddFB2WithModifiers
-    if (drmModeAddFB2(fd, handle->width, handle->height,
-            format, handles, handle->strides, handle->offsets, id, 0)) {
+    if (drmModeAddFB2(gem.fd(), handle->width, handle->height,
+            format, handles->data(), handle->strides, handle->offsets, id, 0)) {
         PLOG(ERROR) << "drmModeAddFB2 failed";
     }
 }
-}
 
-bool addFramebuffer(int fd, buffer_handle_t buffer, uint32_t* id) {
+cros_gralloc_handle_t getHandle(buffer_handle_t buffer) {
+    // Each plane has its own fd (and GEM handle)
     auto planes = buffer->numFds;
-    if (planes < 1 && planes > DRV_MAX_PLANES)
-        return false;
+    if (planes < 1 || planes > DRV_MAX_PLANES
+            || planes > static_cast<int>(std::tuple_size<GemHandles>::value))
+        return nullptr;
     if ((buffer->numInts + planes) < static_cast<int>(handle_data_size))
-        return false;
+        return nullptr;
 
     auto handle = reinterpret_cast<cros_gralloc_handle_t>(buffer);
-    if (handle->magic != cros_gralloc_magic)
+    return handle->magic == cros_gralloc_magic ? handle : nullptr;
+}
+}
+
+bool addFramebuffer(DrmGemHandleTable& gem, buffer_handle_t buffer,
+        uint32_t* id, GemHandles* handles) {
+    auto handle = getHandle(buffer);
+    if (!handle)
+        return false;
+
+    addFramebuffer(gem, handle, buffer->numFds, id, handles);
+    return true;
+}
+
+bool getBufferInfo(buffer_handle_t buffer, BufferInfo* info) {
+    auto handle = getHandle(buffer);
+    if (!handle)
         return false;
 
-    addFramebuffer(fd, handle, planes, id);
+    *info = {
+        .fd = handle->fds[0],
+        .width = handle->width,
+        .height = handle->height,
+        .format = handle->format,
+        .stride = handle->strides[0],
+        .offset = handle->offsets[0],
+        .modifier = handle->format_modifier,
+    };
     return true;
 }
 
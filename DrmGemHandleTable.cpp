@@ -0,0 +1,59 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (C) 2019 Stephan Gerhold
+
+#define LOG_TAG "drmfb-gem"
+
+#include <android-base/logging.h>
+#include <xf86drm.h>
+#include "DrmDevice.h"
+#include "DrmGemHandleTable.h"
+
+namespace android {
+namespace hardware {
+namespace graphics {
+namespace composer {
+namespace V2_1 {
+namespace drmfb {
+
+DrmGemHandleTable::DrmGemHandleTable(const DrmDevice& device) : mDevice(device) {}
+
+int DrmGemHandleTable::fd() const {
+    return mDevice.fd();
+}
+
+bool DrmGemHandleTable::import(int primeFd, uint32_t* handle) {
+    // Hold the lock so the handle cannot be closed while it is imported again
+    std::scoped_lock lock{mMutex};
+    if (drmPrimeFDToHandle(mDevice.fd(), primeFd, handle)) {
+        PLOG(ERROR) << "Failed to get handle for prime fd " << primeFd;
+        return false;
+    }
+
+    ++mReferences[*handle];
+    return true;
+}
+
+void DrmGemHandleTable::release(uint32_t handle) {
+    std::scoped_lock lock{mMutex};
+    auto i = mReferences.find(handle);
+    if (i == mReferences.end()) {
+        LOG(ERROR) << "Attempted to release unknown GEM handle " << handle;
+        return;
+    }
+
+    if (--i->second > 0)
+        return;
+    mReferences.erase(i);
+
+    drm_gem_close args{ .handle = handle };
+    if (drmIoctl(mDevice.fd(), DRM_IOCTL_GEM_CLOSE, &args)) {
+        PLOG(ERROR) << "Failed to close GEM handle " << handle;
+    }
+}
+
+}  // namespace drmfb
+}  // namespace V2_1
+}  // namespace composer
+}  // namespace graphics
+}  // namespace hardware
+}  // namespace android
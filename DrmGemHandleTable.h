@@ -0,0 +1,45 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (C) 2019 Stephan Gerhold
+
+#pragma once
+
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+
+namespace android {
+namespace hardware {
+namespace graphics {
+namespace composer {
+namespace V2_1 {
+namespace drmfb {
+
+struct DrmDevice;
+
+/*
+ * Reference counts the GEM handles of a DRM device. The kernel returns the
+ * same GEM handle when the same buffer is imported multiple times (e.g. for
+ * multiple planes or framebuffers), but it is only closed once. Therefore,
+ * the handle must be kept until all users have released it.
+ */
+struct DrmGemHandleTable {
+    DrmGemHandleTable(const DrmDevice& device);
+
+    bool import(int primeFd, uint32_t* handle);
+    void release(uint32_t handle);
+
+    int fd() const;
+
+private:
+    const DrmDevice& mDevice;
+
+    std::mutex mMutex;
+    std::unordered_map<uint32_t, unsigned> mReferences;
+};
+
+}  // namespace drmfb
+}  // namespace V2_1
+}  // namespace composer
+}  // namespace graphics
+}  // namespace hardware
+}  // namespace android
@@ -3,9 +3,10 @@
 
 #define LOG_TAG "drmfb-hotplug"
 
-#include <cutils/uevent.h>
-#include <android-base/unique_fd.h>
+#include <algorithm>
+#include <vector>
 #include <android-base/logging.h>
+#include <android-base/properties.h>
 #include "DrmHotplugThread.h"
 #include "DrmDevice.h"
 
@@ -17,44 +18,71 @@ namespace V2_1 {
 namespace drmfb {
 
 namespace {
-constexpr int RECEIVE_BUFFER = 1 * 1024 * 1024; // 1 MiB
-constexpr int MESSAGE_BUFFER = 1 * 1024; // 1 KiB
+constexpr unsigned MAX_DEBOUNCE = 5000; // ms
 }
 
 DrmHotplugThread::DrmHotplugThread(DrmDevice& device)
-    : GraphicsThread("drm-hotplug"), mDevice(device) {}
+    : GraphicsThread("drm-hotplug", ThreadClass::HOTPLUG), mDevice(device),
+      mDebounce(std::chrono::milliseconds(
+          base::GetUintProperty<unsigned>("hwc.drm.hotplug.debounce", 200, MAX_DEBOUNCE))) {}
 
-bool DrmHotplugThread::receiveEvent(int fd) {
-    char msg[MESSAGE_BUFFER];
-    auto n = uevent_kernel_multicast_recv(fd, msg, sizeof(msg));
-    if (n < 0)
-        return false;
-
-    bool drm = false;
-    bool hotplug = false;
-    for (auto buf = msg, end = msg + n; buf < end; buf += strlen(buf) + 1) {
-        if (!strcmp(buf, "DEVTYPE=drm_minor"))
-            drm = true;
-        else if (!strcmp(buf, "HOTPLUG=1"))
-            hotplug = true;
-    }
+void DrmHotplugThread::schedule(uint32_t connector) {
+    std::scoped_lock lock{mPendingMutex};
+    // Restart the debounce window with each event
+    mPending[connector] = Clock::now() + mDebounce;
+    enable();
+    mPendingCondition.notify_all();
+}
 
-    return drm && hotplug;
+void DrmHotplugThread::wake() {
+    // Not called with the lock held, so the notification cannot be missed while waiting
+    std::scoped_lock lock{mPendingMutex};
+    mPendingCondition.notify_all();
 }
 
-void DrmHotplugThread::work(std::unique_lock<std::mutex>& lock) {
-    base::unique_fd fd{uevent_open_socket(RECEIVE_BUFFER, true)};
-    if (fd < 0) {
-        PLOG(ERROR) << "Failed to open uevent socket";
-        return;
-    }
+void DrmHotplugThread::run() {
+    std::vector<uint32_t> connectors;
+    {
+        std::unique_lock lock{mPendingMutex};
+        if (mPending.empty()) {
+            // Sleep until the next hotplug event (disable() calls wake(), which takes the lock)
+            lock.unlock();
+            disable();
+            lock.lock();
+            if (!mPending.empty())
+                enable(); // Scheduled in the meantime
+            return;
+        }
 
-    loop(lock, [this, &fd] {
-        if (receiveEvent(fd)) {
-            LOG(DEBUG) << "Received hotplug uevent";
-            mDevice.update();
+        auto now = Clock::now();
+        auto next = Clock::time_point::max();
+        for (auto i = mPending.begin(); i != mPending.end();) {
+            if (i->second <= now) {
+                // steady_clock uses CLOCK_MONOTONIC, like the other event timestamps
+                recordWakeup(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    i->second.time_since_epoch()).count());
+                connectors.push_back(i->first);
+                i = mPending.erase(i);
+            } else {
+                next = std::min(next, i->second);
+                ++i;
+            }
         }
-    });
+
+        if (connectors.empty()) {
+            // Wait until the window ends, or for new events (or to stop)
+            mPendingCondition.wait_until(lock, next);
+            return;
+        }
+    }
+
+    // All events received for a connector in the meantime are handled at once
+    if (std::find(connectors.begin(), connectors.end(), 0) != connectors.end()) {
+        mDevice.update();
+    } else {
+        for (auto connector : connectors)
+            mDevice.update(connector);
+    }
 }
 
 }  // namespace drmfb
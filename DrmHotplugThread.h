@@ -3,6 +3,9 @@
 
 #pragma once
 
+#include <chrono>
+#include <condition_variable>
+#include <unordered_map>
 #include "GraphicsThread.h"
 
 namespace android {
@@ -14,16 +17,34 @@ namespace drmfb {
 
 struct DrmDevice;
 
+/*
+ * Updates the displays of the device after a hotplug event. Probing the
+ * connectors is slow and may wait for the displays (e.g. to disable them),
+ * so it cannot be done on the event thread.
+ *
+ * Hotplug events are debounced per connector: the connector is only updated
+ * once no further events were received for it within the debounce window,
+ * so a burst of events (e.g. from a flaky cable) results in a single update.
+ */
 struct DrmHotplugThread : public GraphicsThread {
     DrmHotplugThread(DrmDevice& device);
 
+    void schedule(uint32_t connector); // Called from the event thread, 0 for all
+
 protected:
-    void work(std::unique_lock<std::mutex>& lock) override;
+    void run() override;
+    void wake() override;
 
 private:
-    bool receiveEvent(int fd);
+    using Clock = std::chrono::steady_clock;
 
     DrmDevice& mDevice;
+    const Clock::duration mDebounce;
+
+    std::mutex mPendingMutex;
+    std::condition_variable mPendingCondition;
+    // Connector (0 for all) -> time when it should be updated
+    std::unordered_map<uint32_t, Clock::time_point> mPending;
 };
 
 }  // namespace drmfb
@@ -0,0 +1,109 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (C) 2019 Stephan Gerhold
+
+#define LOG_TAG "drmfb-vsync"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include "DrmVsyncModel.h"
+
+namespace android {
+namespace hardware {
+namespace graphics {
+namespace composer {
+namespace V2_1 {
+namespace drmfb {
+
+namespace {
+constexpr size_t MIN_SAMPLES = 6;
+constexpr int64_t RESYNC_THRESHOLD = 500'000; // 0.5 ms
+constexpr int64_t MAX_PERIOD_DEVIATION = 100; // 1 %
+
+constexpr int64_t floorDiv(int64_t a, int64_t b) {
+    auto q = a / b;
+    return (a % b != 0 && (a < 0) != (b < 0)) ? q - 1 : q;
+}
+}
+
+void DrmVsyncModel::reset(int64_t period) {
+    mNominalPeriod = mPeriod = period;
+    mPhase = 0;
+    mCount = mNext = 0;
+    mLocked = false;
+}
+
+void DrmVsyncModel::assume(int64_t timestamp) {
+    // Keep the phase of existing samples (e.g. from page flips)
+    if (!mCount)
+        mPhase = timestamp;
+    mLocked = true;
+}
+
+bool DrmVsyncModel::addSample(int64_t timestamp) {
+    if (mPeriod <= 0)
+        return true; // Not initialized yet
+
+    auto fits = true;
+    if (mCount || mLocked) {
+        // Distance to the closest predicted vsync
+        auto offset = timestamp - mPhase;
+        auto error = offset - floorDiv(offset + mPeriod / 2, mPeriod) * mPeriod;
+        if (std::abs(error) > RESYNC_THRESHOLD) {
+            reset(mNominalPeriod);
+            fits = false;
+        }
+    }
+
+    mSamples[mNext] = timestamp;
+    mNext = (mNext + 1) % MAX_SAMPLES;
+    mCount = std::min(mCount + 1, MAX_SAMPLES);
+    fit();
+
+    if (mCount >= MIN_SAMPLES)
+        mLocked = true;
+    return fits;
+}
+
+void DrmVsyncModel::fit() {
+    auto last = mSamples[(mNext + MAX_SAMPLES - 1) % MAX_SAMPLES];
+    if (mCount < 2) {
+        mPhase = last;
+        return;
+    }
+
+    // Linear regression of the timestamps over the vsync index (relative to the last sample)
+    double sk = 0, st = 0, skk = 0, skt = 0;
+    for (size_t i = 0; i < mCount; ++i) {
+        auto t = static_cast<double>(mSamples[i] - last);
+        auto k = std::round(t / mPeriod);
+        sk += k;
+        st += t;
+        skk += k * k;
+        skt += k * t;
+    }
+
+    double n = mCount;
+    double den = n * skk - sk * sk;
+    double period = den > 0 ? (n * skt - sk * st) / den : 0;
+    if (std::abs(period - mNominalPeriod) * MAX_PERIOD_DEVIATION > mNominalPeriod) {
+        // Not enough distinct samples (or something is wrong), keep the nominal period
+        mPeriod = mNominalPeriod;
+        mPhase = last;
+        return;
+    }
+
+    mPeriod = std::llround(period);
+    mPhase = last + std::llround((st - period * sk) / n);
+}
+
+int64_t DrmVsyncModel::predict(int64_t after) const {
+    return mPhase + (floorDiv(after - mPhase, mPeriod) + 1) * mPeriod;
+}
+
+}  // namespace drmfb
+}  // namespace V2_1
+}  // namespace composer
+}  // namespace graphics
+}  // namespace hardware
+}  // namespace android
@@ -0,0 +1,56 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (C) 2019 Stephan Gerhold
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+
+namespace android {
+namespace hardware {
+namespace graphics {
+namespace composer {
+namespace V2_1 {
+namespace drmfb {
+
+/*
+ * Software model of the vsync signal of a display. The period and phase are
+ * fitted (using linear regression) to timestamps reported by the hardware
+ * (vblank and page flip events). Once enough samples are available, vsync
+ * can be predicted without waiting for each vblank event.
+ */
+struct DrmVsyncModel {
+    // Reset the model (e.g. after a mode change) with the nominal period
+    void reset(int64_t period);
+    // Start the model without hardware samples (if vblank events are not available)
+    void assume(int64_t timestamp);
+
+    // Returns false if the sample did not match the model (the model is reset)
+    bool addSample(int64_t timestamp);
+
+    inline bool locked() const { return mLocked; }
+    inline int64_t period() const { return mPeriod; }
+
+    // Returns the first predicted vsync timestamp after the specified time
+    int64_t predict(int64_t after) const;
+
+private:
+    void fit();
+
+    static constexpr size_t MAX_SAMPLES = 16;
+    std::array<int64_t, MAX_SAMPLES> mSamples;
+    size_t mCount = 0;
+    size_t mNext = 0;
+
+    int64_t mNominalPeriod = 0;
+    int64_t mPeriod = 0;
+    int64_t mPhase = 0; // Timestamp of a vsync
+    bool mLocked = false;
+};
+
+}  // namespace drmfb
+}  // namespace V2_1
+}  // namespace composer
+}  // namespace graphics
+}  // namespace hardware
+}  // namespace android
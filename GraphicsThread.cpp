@@ -5,8 +5,6 @@
 
 #include <android-base/logging.h>
 #include <sys/prctl.h>
-#include <sys/resource.h>
-#include <system/graphics.h>
 #include "GraphicsThread.h"
 
 namespace android {
@@ -16,8 +14,8 @@ namespace composer {
 namespace V2_1 {
 namespace drmfb {
 
-GraphicsThread::GraphicsThread(std::string name)
-    : mName(std::move(name)) {}
+GraphicsThread::GraphicsThread(std::string name, ThreadClass threadClass)
+    : mName(std::move(name)), mClass(threadClass) {}
 
 GraphicsThread::~GraphicsThread() {
     stop();
@@ -39,8 +37,12 @@ void GraphicsThread::enable() {
 }
 
 void GraphicsThread::disable() {
-    std::scoped_lock lock{mMutex};
-    mEnabled = false;
+    {
+        std::scoped_lock lock{mMutex};
+        mEnabled = false;
+    }
+
+    wake();
 }
 
 void GraphicsThread::stop() {
@@ -54,12 +56,13 @@ void GraphicsThread::stop() {
     }
 
     mCondition.notify_all();
+    wake();
     mThread.join();
 }
 
 void GraphicsThread::main() {
-    setpriority(PRIO_PROCESS, 0, HAL_PRIORITY_URGENT_DISPLAY);
     prctl(PR_SET_NAME, mName.c_str(), 0, 0, 0);
+    ThreadScheduling::get(mClass).apply();
 
     LOG(DEBUG) << "Starting thread " << mName;
 
@@ -6,6 +6,7 @@
 #include <condition_variable>
 #include <mutex>
 #include <thread>
+#include "ThreadScheduling.h"
 
 namespace android {
 namespace hardware {
@@ -15,16 +16,23 @@ namespace V2_1 {
 namespace drmfb {
 
 struct GraphicsThread {
-    GraphicsThread(std::string name);
+    GraphicsThread(std::string name, ThreadClass threadClass);
     virtual ~GraphicsThread();
 
     void enable();
     void disable();
     void stop();
 
+    inline const std::string& name() const { return mName; }
+    inline const WakeupLatency& latency() const { return mLatency; }
+    // Called by the thread when it handles an event that occurred at the time
+    inline void recordWakeup(int64_t eventTime) { mLatency.record(eventTime); }
+
 protected:
     virtual void run() {};
     virtual void work(std::unique_lock<std::mutex>& lock);
+    // Called when the thread should stop blocking (e.g. to disable it)
+    virtual void wake() {};
 
     template<typename F>
     void loop(std::unique_lock<std::mutex>& lock, F f) {
@@ -41,9 +49,11 @@ private:
     std::mutex mMutex;
     std::thread mThread;
     std::string mName;
+    const ThreadClass mClass;
+    WakeupLatency mLatency;
 
-    bool mStarted;
-    bool mEnabled;
+    bool mStarted = false;
+    bool mEnabled = false;
     std::condition_variable mCondition;
 };
 
@@ -0,0 +1,102 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (C) 2019 Stephan Gerhold
+
+#define LOG_TAG "drmfb-layers"
+
+#include "LayerTable.h"
+
+namespace android {
+namespace hardware {
+namespace graphics {
+namespace composer {
+namespace V2_1 {
+namespace drmfb {
+
+namespace {
+constexpr uint32_t slotOf(Layer layer) {
+    return static_cast<uint32_t>(layer);
+}
+constexpr uint32_t generationOf(Layer layer) {
+    return static_cast<uint32_t>(layer >> 32);
+}
+constexpr Layer makeLayer(uint32_t generation, uint32_t slot) {
+    return static_cast<Layer>(generation) << 32 | slot;
+}
+}
+
+template<typename F>
+void LayerTable::forEachColumn(F f) {
+    f(ids);
+    f(composition);
+    f(buffer);
+    f(acquireFence);
+    f(bufferChanged);
+    f(damage);
+    f(displayFrame);
+    f(sourceCrop);
+    f(transform);
+    f(blendMode);
+    f(alpha);
+    f(z);
+    f(color);
+    f(x);
+    f(y);
+}
+
+Layer LayerTable::create() {
+    uint32_t slot;
+    if (mFreeSlots.empty()) {
+        slot = mSlots.size();
+        mSlots.emplace_back();
+    } else {
+        slot = mFreeSlots.back();
+        mFreeSlots.pop_back();
+    }
+
+    forEachColumn([] (auto& column) { column.emplace_back(); });
+
+    auto layer = makeLayer(mSlots[slot].generation, slot);
+    mSlots[slot].index = ids.size() - 1;
+    ids.back() = layer;
+    composition.back() = IComposerClient::Composition::INVALID;
+    blendMode.back() = HWC2_BLEND_MODE_NONE;
+    alpha.back() = 1.0f;
+    return layer;
+}
+
+bool LayerTable::destroy(Layer layer) {
+    auto index = find(layer);
+    if (index == NONE)
+        return false;
+
+    // Move the last layer into the free space to keep the arrays dense
+    auto last = ids.size() - 1;
+    if (index != last) {
+        forEachColumn([index, last] (auto& column) {
+            column[index] = std::move(column[last]);
+        });
+        mSlots[slotOf(ids[index])].index = index;
+    }
+    forEachColumn([] (auto& column) { column.pop_back(); });
+
+    auto& slot = mSlots[slotOf(layer)];
+    slot.index = UINT32_MAX;
+    ++slot.generation;
+    mFreeSlots.push_back(slotOf(layer));
+    return true;
+}
+
+size_t LayerTable::find(Layer layer) const {
+    auto slot = slotOf(layer);
+    if (slot >= mSlots.size() || mSlots[slot].generation != generationOf(layer)
+            || mSlots[slot].index == UINT32_MAX)
+        return NONE;
+    return mSlots[slot].index;
+}
+
+}  // namespace drmfb
+}  // namespace V2_1
+}  // namespace composer
+}  // namespace graphics
+}  // namespace hardware
+}  // namespace android
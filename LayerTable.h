@@ -0,0 +1,73 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (C) 2019 Stephan Gerhold
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <android-base/unique_fd.h>
+#include <composer-hal/2.1/ComposerHal.h>
+
+namespace android {
+namespace hardware {
+namespace graphics {
+namespace composer {
+namespace V2_1 {
+namespace drmfb {
+
+/*
+ * The layers of a single display, stored as structure of arrays.
+ * The arrays are kept dense (destroyed layers are replaced with the last one),
+ * so all layers can be iterated using an index in [0, size()).
+ *
+ * Layer IDs consist of a slot (lower 32 bits) and a generation (upper 32 bits)
+ * that is incremented when the slot is reused, so stale IDs are detected.
+ */
+struct LayerTable {
+    static constexpr size_t NONE = SIZE_MAX;
+
+    Layer create();
+    bool destroy(Layer layer);
+
+    // Returns the index of the layer, or NONE if it does not exist
+    size_t find(Layer layer) const;
+    inline size_t size() const { return ids.size(); }
+
+    std::vector<Layer> ids;
+    std::vector<IComposerClient::Composition> composition;
+
+    std::vector<buffer_handle_t> buffer;
+    std::vector<base::unique_fd> acquireFence;
+    std::vector<uint8_t> bufferChanged; // Not std::vector<bool>, to avoid the proxy references
+    std::vector<std::vector<hwc_rect_t>> damage;
+
+    std::vector<hwc_rect_t> displayFrame;
+    std::vector<hwc_frect_t> sourceCrop;
+    std::vector<int32_t> transform;
+    std::vector<int32_t> blendMode;
+    std::vector<float> alpha;
+    std::vector<uint32_t> z;
+    std::vector<IComposerClient::Color> color; // For SOLID_COLOR layers
+
+    // Cursor position (updated separately from the display frame)
+    std::vector<int32_t> x, y;
+
+private:
+    template<typename F>
+    void forEachColumn(F f);
+
+    struct Slot {
+        uint32_t generation = 1;
+        uint32_t index = UINT32_MAX; // In the arrays above, if used
+    };
+    std::vector<Slot> mSlots;
+    std::vector<uint32_t> mFreeSlots;
+};
+
+}  // namespace drmfb
+}  // namespace V2_1
+}  // namespace composer
+}  // namespace graphics
+}  // namespace hardware
+}  // namespace android
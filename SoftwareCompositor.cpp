@@ -0,0 +1,500 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (C) 2019 Stephan Gerhold
+
+#define LOG_TAG "drmfb-compositor"
+
+#include <algorithm>
+#include <cmath>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/dma-buf.h>
+#include <android-base/logging.h>
+#include <drm/drm_fourcc.h>
+#include <sync/sync.h>
+#include "DrmDevice.h"
+#include "SoftwareCompositor.h"
+
+namespace android {
+namespace hardware {
+namespace graphics {
+namespace composer {
+namespace V2_1 {
+namespace drmfb {
+
+namespace {
+constexpr int FENCE_TIMEOUT = 1000; // ms
+constexpr uint32_t OPAQUE = 0xff000000;
+
+bool supportsFormat(uint32_t format) {
+    // Same channel order as the output buffer
+    return format == DRM_FORMAT_ABGR8888 || format == DRM_FORMAT_XBGR8888;
+}
+
+// RGBA and BGRA (with or without alpha), -1 for unsupported formats
+int channelOrder(uint32_t format) {
+    switch (format) {
+    case DRM_FORMAT_ABGR8888:
+    case DRM_FORMAT_XBGR8888:
+        return 0;
+    case DRM_FORMAT_ARGB8888:
+    case DRM_FORMAT_XRGB8888:
+        return 1;
+    default:
+        return -1;
+    }
+}
+
+bool supportsTransform(int32_t transform) {
+    switch (transform) {
+    case 0:
+    case HWC_TRANSFORM_FLIP_H:
+    case HWC_TRANSFORM_FLIP_V:
+    case HWC_TRANSFORM_ROT_90:
+    case HWC_TRANSFORM_ROT_180:
+    case HWC_TRANSFORM_ROT_270:
+        return true;
+    default:
+        return false;
+    }
+}
+
+inline bool isInteger(float f) {
+    return std::floor(f) == f;
+}
+
+inline uint8_t planeAlpha(float alpha) {
+    return static_cast<uint8_t>(std::lround(std::clamp(alpha, 0.0f, 1.0f) * 255));
+}
+
+inline uint32_t premultiply(uint32_t c, uint32_t a) {
+    return (c * a + 127) / 255;
+}
+
+// Solid colors as premultiplied ABGR8888
+uint32_t convertColor(const IComposerClient::Color& color) {
+    return color.a << 24 | premultiply(color.b, color.a) << 16
+        | premultiply(color.g, color.a) << 8 | premultiply(color.r, color.a);
+}
+
+void syncBuffer(int fd, uint64_t flags) {
+    // Not supported by older kernels, but still worth trying
+    dma_buf_sync sync{ .flags = flags };
+    ioctl(fd, DMA_BUF_IOCTL_SYNC, &sync);
+}
+
+// Maps a pixel of the display frame (u, v) to the source crop (for a w x h frame)
+inline void transformPoint(int32_t transform, int32_t u, int32_t v,
+        int32_t w, int32_t h, int32_t* sx, int32_t* sy) {
+    switch (transform) {
+    case HWC_TRANSFORM_FLIP_H:
+        *sx = w - 1 - u; *sy = v;
+        break;
+    case HWC_TRANSFORM_FLIP_V:
+        *sx = u; *sy = h - 1 - v;
+        break;
+    case HWC_TRANSFORM_ROT_90:
+        *sx = v; *sy = w - 1 - u;
+        break;
+    case HWC_TRANSFORM_ROT_180:
+        *sx = w - 1 - u; *sy = h - 1 - v;
+        break;
+    case HWC_TRANSFORM_ROT_270:
+        *sx = h - 1 - v; *sy = u;
+        break;
+    default:
+        *sx = u; *sy = v;
+        break;
+    }
+}
+}
+
+SoftwareCompositor::Rect SoftwareCompositor::Rect::intersect(const Rect& other) const {
+    return {std::max(left, other.left), std::max(top, other.top),
+            std::min(right, other.right), std::min(bottom, other.bottom)};
+}
+
+SoftwareCompositor::Rect SoftwareCompositor::Rect::unite(const Rect& other) const {
+    if (empty())
+        return other;
+    if (other.empty())
+        return *this;
+    return {std::min(left, other.left), std::min(top, other.top),
+            std::max(right, other.right), std::max(bottom, other.bottom)};
+}
+
+bool SoftwareCompositor::Geometry::operator==(const Geometry& other) const {
+    return id == other.id && composition == other.composition
+        && frame.left == other.frame.left && frame.top == other.frame.top
+        && frame.right == other.frame.right && frame.bottom == other.frame.bottom
+        && crop.left == other.crop.left && crop.top == other.crop.top
+        && crop.right == other.crop.right && crop.bottom == other.crop.bottom
+        && transform == other.transform && blendMode == other.blendMode
+        && alpha == other.alpha
+        && color.r == other.color.r && color.g == other.color.g
+        && color.b == other.color.b && color.a == other.color.a;
+}
+
+SoftwareCompositor::SoftwareCompositor(DrmDevice& device)
+    : mDevice(device), mKernels(blendKernels()) {
+    LOG(INFO) << "Using " << mKernels.name << " blend kernels for software composition";
+}
+
+bool SoftwareCompositor::supports(const LayerTable& layers, size_t i) {
+    if (layers.blendMode[i] == HWC2_BLEND_MODE_COVERAGE)
+        return false;
+
+    switch (layers.composition[i]) {
+    case IComposerClient::Composition::SOLID_COLOR:
+        return true;
+    case IComposerClient::Composition::DEVICE:
+        break;
+    default:
+        return false;
+    }
+
+    const auto& frame = layers.displayFrame[i];
+    const auto& crop = layers.sourceCrop[i];
+    auto transform = layers.transform[i];
+    if (!supportsTransform(transform))
+        return false;
+
+    // No scaling
+    if (!isInteger(crop.left) || !isInteger(crop.top)
+            || !isInteger(crop.right) || !isInteger(crop.bottom))
+        return false;
+    auto w = frame.right - frame.left, h = frame.bottom - frame.top;
+    if (transform & HWC_TRANSFORM_ROT_90)
+        std::swap(w, h);
+    if (crop.right - crop.left != w || crop.bottom - crop.top != h)
+        return false;
+
+    BufferInfo info;
+    auto buffer = layers.buffer[i];
+    return buffer && getBufferInfo(buffer, &info) && supportsFormat(info.format)
+        && crop.left >= 0 && crop.top >= 0
+        && crop.right <= info.width && crop.bottom <= info.height;
+}
+
+SoftwareCompositor::Rect SoftwareCompositor::damage(LayerTable& layers,
+        const std::vector<size_t>& order, const Rect& screen) {
+    std::vector<Geometry> geometry;
+    geometry.reserve(order.size());
+    for (auto i : order) {
+        geometry.push_back({layers.ids[i], layers.composition[i],
+            layers.displayFrame[i], layers.sourceCrop[i], layers.transform[i],
+            layers.blendMode[i], layers.alpha[i], layers.color[i]});
+    }
+
+    // Layers were added, removed, moved or changed otherwise
+    if (geometry != mGeometry) {
+        mGeometry = std::move(geometry);
+        return screen;
+    }
+
+    Rect damage;
+    for (auto i : order) {
+        if (!layers.bufferChanged[i])
+            continue;
+
+        const auto& frame = layers.displayFrame[i];
+        Rect frameRect{frame.left, frame.top, frame.right, frame.bottom};
+        if (layers.damage[i].empty() || layers.transform[i]) {
+            damage = damage.unite(frameRect);
+            continue;
+        }
+
+        // Map the surface damage from buffer to display coordinates
+        auto dx = frame.left - static_cast<int32_t>(layers.sourceCrop[i].left);
+        auto dy = frame.top - static_cast<int32_t>(layers.sourceCrop[i].top);
+        for (const auto& r : layers.damage[i]) {
+            Rect rect{r.left + dx, r.top + dy, r.right + dx, r.bottom + dy};
+            damage = damage.unite(rect.intersect(frameRect));
+        }
+    }
+    return damage.intersect(screen);
+}
+
+std::shared_ptr<const DrmFramebuffer> SoftwareCompositor::compose(LayerTable& layers,
+        const std::vector<size_t>& order, uint32_t width, uint32_t height,
+        std::shared_ptr<SoftwareFrame>* frame) {
+    Rect screen{0, 0, static_cast<int32_t>(width), static_cast<int32_t>(height)};
+    if (width != mWidth || height != mHeight) {
+        // The mode has changed, the output buffers need to be allocated again
+        mWidth = width;
+        mHeight = height;
+        mOutputs = {};
+        mGeometry.clear();
+    }
+
+    auto frameDamage = damage(layers, order, screen);
+    for (auto i : order)
+        layers.bufferChanged[i] = false;
+
+    mComposed = false;
+    frame->reset();
+    auto& current = mOutputs[mCurrent].framebuffer;
+    if (frameDamage.empty() && current)
+        return current;
+
+    // Damage of the frames since the next output buffer was last used
+    auto next = (mCurrent + 1) % BUFFERS;
+    auto& output = mOutputs[next];
+    mDamage[++mFrame % BUFFERS] = frameDamage;
+
+    auto rect = frameDamage;
+    if (!output.framebuffer || output.frame + BUFFERS < mFrame) {
+        rect = screen;
+    } else {
+        for (auto f = output.frame + 1; f < mFrame; ++f)
+            rect = rect.unite(mDamage[f % BUFFERS]);
+    }
+
+    if (!output.framebuffer) {
+        output.framebuffer = std::make_shared<DrmFramebuffer>(mDevice, width, height);
+        if (!output.framebuffer->pixels()) {
+            output.framebuffer.reset();
+            return nullptr;
+        }
+    }
+
+    // Only take what is needed for rendering, the layers might change meanwhile
+    std::shared_ptr<SoftwareFrame> composed{new SoftwareFrame(mKernels)};
+    composed->mOutput = output.framebuffer;
+    composed->mStale = output.stale;
+    composed->mReleaseFence = std::move(output.releaseFence);
+    composed->mRect = rect;
+    composed->mScreen = screen;
+
+    composed->mSources.reserve(order.size());
+    for (auto i : order) {
+        SoftwareFrame::Source source;
+        source.composition = layers.composition[i];
+        source.frame = layers.displayFrame[i];
+        source.crop = layers.sourceCrop[i];
+        source.transform = layers.transform[i];
+        source.blendMode = layers.blendMode[i];
+        source.alpha = layers.alpha[i];
+        source.color = layers.color[i];
+
+        if (source.composition == IComposerClient::Composition::DEVICE) {
+            if (!getBufferInfo(layers.buffer[i], &source.info))
+                continue;
+
+            source.fd.reset(fcntl(source.info.fd, F_DUPFD_CLOEXEC, 0));
+            if (source.fd < 0) {
+                PLOG(ERROR) << "Failed to duplicate layer buffer";
+                continue;
+            }
+            source.info.fd = source.fd;
+            source.acquireFence = std::move(layers.acquireFence[i]);
+        }
+        composed->mSources.push_back(std::move(source));
+    }
+
+    output.frame = mFrame;
+    mCurrent = next;
+    mComposed = true;
+    *frame = std::move(composed);
+    return output.framebuffer;
+}
+
+void SoftwareCompositor::presented(base::unique_fd presentFence) {
+    // The previous output buffer is released once the new one is displayed
+    if (mComposed)
+        mOutputs[(mCurrent + BUFFERS - 1) % BUFFERS].releaseFence = std::move(presentFence);
+}
+
+SoftwareFrame::~SoftwareFrame() {
+    // Dropped before it was displayed (e.g. replaced in mailbox mode)
+    if (!mRendered)
+        mStale->store(true);
+}
+
+void SoftwareFrame::render() {
+    std::call_once(mOnce, [this] {
+        // Wait until the buffer is no longer displayed
+        if (mReleaseFence >= 0 && sync_wait(mReleaseFence, FENCE_TIMEOUT))
+            PLOG(WARNING) << "Failed to wait for output buffer release";
+        mReleaseFence.reset();
+
+        // The damage is relative to a frame that was never rendered into the buffer
+        auto rect = mStale->exchange(false) ? mScreen : mRect;
+
+        // Clear to black, all layers are blended on top of it
+        const auto& fb = *mOutput;
+        for (auto y = rect.top; y < rect.bottom; ++y) {
+            auto row = reinterpret_cast<uint32_t*>(
+                reinterpret_cast<uint8_t*>(fb.pixels()) + y * fb.pitch());
+            mKernels.fill(row + rect.left, OPAQUE, rect.right - rect.left);
+        }
+
+        for (auto& source : mSources)
+            renderSource(source, rect);
+
+        mSources.clear(); // Close the layer buffers
+        mRendered = true;
+    });
+}
+
+void SoftwareFrame::renderSource(Source& source, const Rect& rect) {
+    const auto& frame = source.frame;
+    Rect frameRect{frame.left, frame.top, frame.right, frame.bottom};
+    auto dst = frameRect.intersect(rect);
+    if (dst.empty())
+        return;
+
+    const auto& output = *mOutput;
+    auto alpha = planeAlpha(source.alpha);
+    auto opaque = source.blendMode == HWC2_BLEND_MODE_NONE;
+    auto count = dst.right - dst.left;
+    auto dstRow = [&] (int32_t y) {
+        return reinterpret_cast<uint32_t*>(
+            reinterpret_cast<uint8_t*>(output.pixels()) + y * output.pitch()) + dst.left;
+    };
+
+    if (source.composition == IComposerClient::Composition::SOLID_COLOR) {
+        auto color = convertColor(source.color);
+        if (opaque)
+            color |= OPAQUE;
+        if (color >> 24 == 0xff && alpha == 0xff) {
+            for (auto y = dst.top; y < dst.bottom; ++y)
+                mKernels.fill(dstRow(y), color, count);
+        } else {
+            mRow.resize(count);
+            mKernels.fill(mRow.data(), color, count);
+            for (auto y = dst.top; y < dst.bottom; ++y)
+                mKernels.blend(dstRow(y), mRow.data(), count, alpha);
+        }
+        return;
+    }
+
+    auto& acquireFence = source.acquireFence;
+    if (acquireFence >= 0 && sync_wait(acquireFence, FENCE_TIMEOUT)) {
+        PLOG(ERROR) << "Failed to wait for layer acquire fence";
+        return;
+    }
+    acquireFence.reset();
+
+    const auto& info = source.info;
+    opaque = opaque || info.format == DRM_FORMAT_XBGR8888;
+
+    size_t size = info.offset + info.stride * info.height;
+    auto addr = mmap(nullptr, size, PROT_READ, MAP_SHARED, info.fd, 0);
+    if (addr == MAP_FAILED) {
+        PLOG(ERROR) << "Failed to mmap layer buffer";
+        return;
+    }
+
+    syncBuffer(info.fd, DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ);
+
+    auto transform = source.transform;
+    auto w = frame.right - frame.left, h = frame.bottom - frame.top;
+    auto cropLeft = static_cast<int32_t>(source.crop.left);
+    auto cropTop = static_cast<int32_t>(source.crop.top);
+    auto base = static_cast<const uint8_t*>(addr) + info.offset;
+    auto srcPixel = [&] (int32_t sx, int32_t sy) {
+        return reinterpret_cast<const uint32_t*>(base + (cropTop + sy) * info.stride) + cropLeft + sx;
+    };
+
+    // Rows are contiguous in the source if there is no horizontal flip or rotation
+    auto contiguous = transform == 0 || transform == HWC_TRANSFORM_FLIP_V;
+    for (auto y = dst.top; y < dst.bottom; ++y) {
+        int32_t sx, sy;
+        const uint32_t* src;
+        if (contiguous) {
+            transformPoint(transform, dst.left - frame.left, y - frame.top, w, h, &sx, &sy);
+            src = srcPixel(sx, sy);
+        } else {
+            mRow.resize(count);
+            for (int32_t x = 0; x < count; ++x) {
+                transformPoint(transform, dst.left + x - frame.left, y - frame.top, w, h, &sx, &sy);
+                mRow[x] = *srcPixel(sx, sy);
+            }
+            src = mRow.data();
+        }
+
+        if (opaque && alpha == 0xff) {
+            mKernels.copy(dstRow(y), src, count);
+        } else if (opaque) {
+            // The alpha channel of the source is undefined
+            mRow.resize(count);
+            for (int32_t x = 0; x < count; ++x)
+                mRow[x] = src[x] | OPAQUE;
+            mKernels.blend(dstRow(y), mRow.data(), count, alpha);
+        } else {
+            mKernels.blend(dstRow(y), src, count, alpha);
+        }
+    }
+
+    syncBuffer(info.fd, DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ);
+    munmap(addr, size);
+}
+
+bool SoftwareCompositor::copy(buffer_handle_t src, base::unique_fd srcFence,
+        buffer_handle_t dst, base::unique_fd dstFence) {
+    BufferInfo in, out;
+    if (!getBufferInfo(src, &in) || !getBufferInfo(dst, &out))
+        return false;
+    return copy(in, std::move(srcFence), out, std::move(dstFence));
+}
+
+bool SoftwareCompositor::copy(const BufferInfo& in, base::unique_fd srcFence,
+        const BufferInfo& out, base::unique_fd dstFence) {
+    auto inOrder = channelOrder(in.format), outOrder = channelOrder(out.format);
+    if (inOrder < 0 || outOrder < 0) {
+        LOG(ERROR) << "Cannot copy buffer with format " << in.format
+            << " into buffer with format " << out.format;
+        return false;
+    }
+
+    for (auto fence : {&srcFence, &dstFence}) {
+        if (*fence >= 0 && sync_wait(*fence, FENCE_TIMEOUT)) {
+            PLOG(ERROR) << "Failed to wait for buffer fence";
+            return false;
+        }
+    }
+
+    size_t inSize = in.offset + in.stride * in.height;
+    size_t outSize = out.offset + out.stride * out.height;
+    auto inAddr = mmap(nullptr, inSize, PROT_READ, MAP_SHARED, in.fd, 0);
+    if (inAddr == MAP_FAILED) {
+        PLOG(ERROR) << "Failed to mmap source buffer";
+        return false;
+    }
+    auto outAddr = mmap(nullptr, outSize, PROT_READ | PROT_WRITE, MAP_SHARED, out.fd, 0);
+    if (outAddr == MAP_FAILED) {
+        PLOG(ERROR) << "Failed to mmap destination buffer";
+        munmap(inAddr, inSize);
+        return false;
+    }
+
+    syncBuffer(in.fd, DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ);
+    syncBuffer(out.fd, DMA_BUF_SYNC_START | DMA_BUF_SYNC_WRITE);
+
+    auto& kernels = blendKernels();
+    auto width = std::min(in.width, out.width), height = std::min(in.height, out.height);
+    for (uint32_t y = 0; y < height; ++y) {
+        auto s = reinterpret_cast<const uint32_t*>(
+            static_cast<const uint8_t*>(inAddr) + in.offset + y * in.stride);
+        auto d = reinterpret_cast<uint32_t*>(
+            static_cast<uint8_t*>(outAddr) + out.offset + y * out.stride);
+        if (inOrder == outOrder)
+            kernels.copy(d, s, width);
+        else
+            kernels.swap(d, s, width);
+    }
+
+    syncBuffer(out.fd, DMA_BUF_SYNC_END | DMA_BUF_SYNC_WRITE);
+    syncBuffer(in.fd, DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ);
+    munmap(outAddr, outSize);
+    munmap(inAddr, inSize);
+    return true;
+}
+
+}  // namespace drmfb
+}  // namespace V2_1
+}  // namespace composer
+}  // namespace graphics
+}  // namespace hardware
+}  // namespace android
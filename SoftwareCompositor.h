@@ -0,0 +1,160 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (C) 2019 Stephan Gerhold
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <android-base/unique_fd.h>
+#include "BlendKernels.h"
+#include "DrmFramebuffer.h"
+#include "LayerTable.h"
+
+namespace android {
+namespace hardware {
+namespace graphics {
+namespace composer {
+namespace V2_1 {
+namespace drmfb {
+
+struct DrmDevice;
+struct SoftwareFrame;
+
+/*
+ * Composes DEVICE and SOLID_COLOR layers using the CPU into dumb buffers,
+ * e.g. if there is no (working) GPU. Only the regions that have changed
+ * since an output buffer was last used are composed again.
+ *
+ * compose() only prepares the frame, the layers are blended on the commit
+ * thread (see SoftwareFrame).
+ *
+ * Supported: RGBA/RGBX buffers without scaling, rotation by 90/180/270 degrees,
+ * flips, premultiplied alpha blending and plane alpha.
+ */
+struct SoftwareCompositor {
+    SoftwareCompositor(DrmDevice& device);
+
+    static bool supports(const LayerTable& layers, size_t i);
+
+    /*
+     * Prepares composing the layers (indexes in z-order) into the next output
+     * buffer, which must be rendered using the returned frame before it is
+     * displayed. If nothing has changed, the last output buffer is returned
+     * again and frame is set to null.
+     */
+    std::shared_ptr<const DrmFramebuffer> compose(LayerTable& layers,
+        const std::vector<size_t>& order, uint32_t width, uint32_t height,
+        std::shared_ptr<SoftwareFrame>* frame);
+
+    // The present fence of the last frame releases the previous output buffer
+    void presented(base::unique_fd presentFence);
+
+    /*
+     * Copies a buffer into another one of the same size (e.g. the client target
+     * into the output buffer of a virtual display), swapping the red and blue
+     * channels if necessary. Waits for both fences first.
+     */
+    static bool copy(buffer_handle_t src, base::unique_fd srcFence,
+                     buffer_handle_t dst, base::unique_fd dstFence);
+    static bool copy(const BufferInfo& src, base::unique_fd srcFence,
+                     const BufferInfo& dst, base::unique_fd dstFence);
+
+private:
+    friend struct SoftwareFrame;
+
+    struct Rect {
+        int32_t left = 0, top = 0, right = 0, bottom = 0;
+
+        inline bool empty() const { return left >= right || top >= bottom; }
+        Rect intersect(const Rect& other) const;
+        Rect unite(const Rect& other) const;
+    };
+
+    // The state of a layer that affects the whole area it covers
+    struct Geometry {
+        Layer id;
+        IComposerClient::Composition composition;
+        hwc_rect_t frame;
+        hwc_frect_t crop;
+        int32_t transform, blendMode;
+        float alpha;
+        IComposerClient::Color color;
+
+        bool operator==(const Geometry& other) const;
+    };
+
+    struct Output {
+        std::shared_ptr<DrmFramebuffer> framebuffer;
+        base::unique_fd releaseFence;
+        uint64_t frame = 0; // The frame that was last composed into the buffer
+        // Set if a frame was dropped before it was rendered into the buffer
+        std::shared_ptr<std::atomic<bool>> stale = std::make_shared<std::atomic<bool>>(false);
+    };
+
+    Rect damage(LayerTable& layers, const std::vector<size_t>& order, const Rect& screen);
+
+    static constexpr size_t BUFFERS = 3;
+
+    DrmDevice& mDevice;
+    const BlendKernels& mKernels;
+
+    uint32_t mWidth = 0, mHeight = 0;
+    std::array<Output, BUFFERS> mOutputs;
+    size_t mCurrent = 0; // Output buffer of the last frame
+    bool mComposed = false; // A new output buffer was used in the last frame
+
+    uint64_t mFrame = 0;
+    std::array<Rect, BUFFERS> mDamage; // Damage of the last frames (by frame % BUFFERS)
+    std::vector<Geometry> mGeometry; // Of the last frame
+};
+
+/*
+ * A frame prepared by SoftwareCompositor::compose(). It is rendered on the
+ * commit thread, so neither the binder thread nor the display lock are held
+ * while waiting for the acquire fences and blending the layers. Displays that
+ * mirror the frame render it only once, frames are rendered in order.
+ */
+struct SoftwareFrame {
+    ~SoftwareFrame();
+    void render();
+
+private:
+    friend struct SoftwareCompositor;
+
+    struct Source {
+        IComposerClient::Composition composition;
+        hwc_rect_t frame;
+        hwc_frect_t crop;
+        int32_t transform, blendMode;
+        float alpha;
+        IComposerClient::Color color;
+        base::unique_fd fd; // The buffer handle might be freed before rendering
+        BufferInfo info;
+        base::unique_fd acquireFence;
+    };
+    using Rect = SoftwareCompositor::Rect;
+
+    SoftwareFrame(const BlendKernels& kernels) : mKernels(kernels) {}
+    void renderSource(Source& source, const Rect& rect);
+
+    const BlendKernels& mKernels;
+    std::shared_ptr<DrmFramebuffer> mOutput;
+    std::shared_ptr<std::atomic<bool>> mStale;
+    base::unique_fd mReleaseFence; // Of the output buffer
+    Rect mRect, mScreen; // Composed again, mScreen if the buffer is stale
+    std::vector<Source> mSources;
+
+    std::once_flag mOnce;
+    bool mRendered = false;
+    std::vector<uint32_t> mRow; // Temporary row for transformed sources
+};
+
+}  // namespace drmfb
+}  // namespace V2_1
+}  // namespace composer
+}  // namespace graphics
+}  // namespace hardware
+}  // namespace android
@@ -0,0 +1,77 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (C) 2019 Stephan Gerhold
+
+#define LOG_TAG "drmfb-sync"
+
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <linux/types.h>
+#include <android-base/logging.h>
+#include "SyncTimeline.h"
+
+namespace android {
+namespace hardware {
+namespace graphics {
+namespace composer {
+namespace V2_1 {
+namespace drmfb {
+
+namespace {
+// From drivers/dma-buf/sw_sync.c (not exported as UAPI header)
+struct sw_sync_create_fence_data {
+    __u32 value;
+    char name[32];
+    __s32 fence;
+};
+
+#define SW_SYNC_IOC_MAGIC 'W'
+#define SW_SYNC_IOC_CREATE_FENCE _IOWR(SW_SYNC_IOC_MAGIC, 0, struct sw_sync_create_fence_data)
+#define SW_SYNC_IOC_INC _IOW(SW_SYNC_IOC_MAGIC, 1, __u32)
+
+int openTimeline() {
+    int fd = open("/dev/sw_sync", O_RDWR | O_CLOEXEC);
+    if (fd < 0)
+        fd = open("/sys/kernel/debug/sync/sw_sync", O_RDWR | O_CLOEXEC);
+    if (fd < 0)
+        PLOG(ERROR) << "Failed to open sw_sync timeline";
+    return fd;
+}
+}
+
+SyncTimeline::SyncTimeline() : mFd(openTimeline()) {}
+
+base::unique_fd SyncTimeline::createFence(uint32_t value) {
+    if (mFd < 0)
+        return {};
+
+    sw_sync_create_fence_data data{ .value = value, .name = "drmfb" };
+    if (ioctl(mFd, SW_SYNC_IOC_CREATE_FENCE, &data)) {
+        PLOG(ERROR) << "Failed to create fence for value " << value;
+        return {};
+    }
+    return base::unique_fd{data.fence};
+}
+
+void SyncTimeline::signal(uint32_t value) {
+    if (mFd < 0)
+        return;
+
+    std::scoped_lock lock{mMutex};
+    // Note: Comparison with wrap-around, the values are 32-bit counters
+    auto inc = value - mValue;
+    if (static_cast<int32_t>(inc) <= 0)
+        return;
+
+    if (ioctl(mFd, SW_SYNC_IOC_INC, &inc)) {
+        PLOG(ERROR) << "Failed to signal timeline to value " << value;
+        return;
+    }
+    mValue = value;
+}
+
+}  // namespace drmfb
+}  // namespace V2_1
+}  // namespace composer
+}  // namespace graphics
+}  // namespace hardware
+}  // namespace android
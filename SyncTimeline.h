@@ -0,0 +1,44 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (C) 2019 Stephan Gerhold
+
+#pragma once
+
+#include <cstdint>
+#include <mutex>
+#include <android-base/unique_fd.h>
+
+namespace android {
+namespace hardware {
+namespace graphics {
+namespace composer {
+namespace V2_1 {
+namespace drmfb {
+
+/*
+ * A software (sw_sync) timeline that can be used to create fences
+ * that are signaled from userspace. Legacy KMS does not provide fences
+ * for page flips, so they are emulated with this timeline.
+ */
+struct SyncTimeline {
+    SyncTimeline();
+
+    inline bool valid() const { return mFd >= 0; }
+
+    // Create a fence that signals once the timeline reaches the value
+    base::unique_fd createFence(uint32_t value);
+    // Advance the timeline to the value (if it is not there already)
+    void signal(uint32_t value);
+
+private:
+    base::unique_fd mFd;
+
+    std::mutex mMutex;
+    uint32_t mValue = 0;
+};
+
+}  // namespace drmfb
+}  // namespace V2_1
+}  // namespace composer
+}  // namespace graphics
+}  // namespace hardware
+}  // namespace android
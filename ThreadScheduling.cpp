@@ -0,0 +1,239 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (C) 2019 Stephan Gerhold
+
+#define LOG_TAG "drmfb-sched"
+
+#include <algorithm>
+#include <string>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <android-base/logging.h>
+#include <android-base/parseint.h>
+#include <android-base/properties.h>
+#include <android-base/strings.h>
+#include <system/graphics.h>
+#include "ThreadScheduling.h"
+
+#ifndef SCHED_FLAG_RESET_ON_FORK
+#define SCHED_FLAG_RESET_ON_FORK 0x01
+#endif
+
+namespace android {
+namespace hardware {
+namespace graphics {
+namespace composer {
+namespace V2_1 {
+namespace drmfb {
+
+namespace {
+constexpr int64_t MICRO = 1000; // ns
+constexpr unsigned MAX_BUDGET = 100000; // µs
+
+// Not defined by all C libraries, see sched_setattr(2)
+struct SchedAttr {
+    uint32_t size;
+    uint32_t sched_policy;
+    uint64_t sched_flags;
+    int32_t sched_nice;
+    uint32_t sched_priority;
+    uint64_t sched_runtime;
+    uint64_t sched_deadline;
+    uint64_t sched_period;
+};
+
+const char* className(ThreadClass threadClass) {
+    switch (threadClass) {
+    case ThreadClass::EVENT:
+        return "event";
+    case ThreadClass::COMMIT:
+        return "commit";
+    case ThreadClass::HOTPLUG:
+        return "hotplug";
+    case ThreadClass::BINDER:
+        return "binder";
+    }
+    return "unknown";
+}
+
+bool parsePolicy(const std::string& value, ThreadScheduling* scheduling) {
+    auto separator = value.find(':');
+    auto name = value.substr(0, separator);
+    auto args = separator != std::string::npos ? value.substr(separator + 1) : "";
+
+    if (name == "fifo" || name == "rr") {
+        scheduling->policy = name == "fifo" ? SCHED_FIFO : SCHED_RR;
+        return base::ParseInt(args, &scheduling->priority,
+            sched_get_priority_min(scheduling->policy),
+            sched_get_priority_max(scheduling->policy));
+    }
+    if (name == "nice") {
+        scheduling->policy = SCHED_OTHER;
+        return base::ParseInt(args, &scheduling->priority, -20, 19);
+    }
+    if (name == "deadline") {
+        auto times = base::Split(args, "/");
+        uint64_t runtime, deadline, period;
+        if (times.size() != 3 || !base::ParseUint(times[0], &runtime)
+                || !base::ParseUint(times[1], &deadline) || !base::ParseUint(times[2], &period))
+            return false;
+
+        // Required by the kernel
+        if (!runtime || runtime > deadline || deadline > period)
+            return false;
+
+        scheduling->policy = SCHED_DEADLINE;
+        scheduling->runtime = runtime * MICRO;
+        scheduling->deadline = deadline * MICRO;
+        scheduling->period = period * MICRO;
+        return true;
+    }
+    return false;
+}
+
+bool parseCpus(const std::string& value, cpu_set_t* cpus) {
+    CPU_ZERO(cpus);
+    for (const auto& range : base::Split(value, ",")) {
+        auto bounds = base::Split(range, "-");
+        unsigned first, last;
+        if (bounds.size() > 2
+                || !base::ParseUint(bounds.front(), &first, CPU_SETSIZE - 1u)
+                || !base::ParseUint(bounds.back(), &last, CPU_SETSIZE - 1u)
+                || first > last)
+            return false;
+
+        for (auto cpu = first; cpu <= last; ++cpu)
+            CPU_SET(cpu, cpus);
+    }
+    return CPU_COUNT(cpus) > 0;
+}
+}
+
+ThreadScheduling ThreadScheduling::get(ThreadClass threadClass) {
+    ThreadScheduling scheduling;
+    if (threadClass == ThreadClass::BINDER) {
+        // Same as SF main thread
+        scheduling.policy = SCHED_FIFO;
+        scheduling.priority = 2;
+    } else {
+        scheduling.priority = HAL_PRIORITY_URGENT_DISPLAY;
+    }
+
+    auto name = className(threadClass);
+    auto property = std::string{"hwc.drm.sched."} + name;
+
+    auto policy = base::GetProperty(property, "");
+    if (!policy.empty()) {
+        auto parsed = scheduling;
+        if (parsePolicy(policy, &parsed))
+            scheduling = parsed;
+        else
+            LOG(ERROR) << "Invalid scheduling policy for " << name << " threads: " << policy;
+    }
+
+    auto cpus = base::GetProperty(property + ".cpus", "");
+    if (!cpus.empty()) {
+        if (scheduling.policy == SCHED_DEADLINE) {
+            // The kernel only allows deadline threads that may run on all CPUs
+            LOG(WARNING) << "Ignoring CPU affinity for " << name << " threads (deadline policy)";
+        } else if (parseCpus(cpus, &scheduling.cpus)) {
+            scheduling.affinity = true;
+        } else {
+            LOG(ERROR) << "Invalid CPU affinity for " << name << " threads: " << cpus;
+        }
+    }
+    return scheduling;
+}
+
+bool ThreadScheduling::apply() const {
+    auto ok = true;
+    if (affinity && sched_setaffinity(0, sizeof(cpus), &cpus)) {
+        PLOG(ERROR) << "Failed to set CPU affinity";
+        ok = false;
+    }
+
+    // Threads started from this one apply their own policy
+    if (policy == SCHED_DEADLINE) {
+        SchedAttr attr{
+            .size = sizeof(attr),
+            .sched_policy = SCHED_DEADLINE,
+            .sched_flags = SCHED_FLAG_RESET_ON_FORK,
+            .sched_nice = 0,
+            .sched_priority = 0,
+            .sched_runtime = runtime,
+            .sched_deadline = deadline,
+            .sched_period = period,
+        };
+        if (syscall(__NR_sched_setattr, 0, &attr, 0)) {
+            PLOG(ERROR) << "Failed to set deadline scheduling policy";
+            ok = false;
+        }
+    } else if (policy == SCHED_OTHER) {
+        if (setpriority(PRIO_PROCESS, 0, priority)) {
+            PLOG(ERROR) << "Failed to set nice value " << priority;
+            ok = false;
+        }
+    } else {
+        sched_param param{ .sched_priority = priority };
+        if (sched_setscheduler(0, policy | SCHED_RESET_ON_FORK, &param)) {
+            PLOG(ERROR) << "Failed to set real-time scheduling policy " << policy
+                << " (priority " << priority << ")";
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+void lockMemory() {
+    if (!base::GetBoolProperty("hwc.drm.sched.mlock", false))
+        return;
+
+    /*
+     * Avoid page faults in the threads, e.g. after memory was reclaimed under
+     * pressure. MCL_FUTURE would also pin (and populate) each buffer that is
+     * mapped temporarily (e.g. for the cursor or software composition).
+     */
+    if (mlockall(MCL_CURRENT))
+        PLOG(ERROR) << "Failed to lock memory";
+    else
+        LOG(INFO) << "Locked the current memory of the process";
+}
+
+WakeupLatency::WakeupLatency()
+    : mBudget(base::GetUintProperty<unsigned>("hwc.drm.sched.budget", 1000, MAX_BUDGET) * MICRO) {}
+
+void WakeupLatency::record(int64_t eventTime) {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    auto latency = std::max<int64_t>(0, int64_t{ts.tv_sec} * 1000 * 1000 * MICRO + ts.tv_nsec
+        - eventTime);
+
+    // Only the thread itself records wakeups, so there are no concurrent updates
+    mCount.fetch_add(1, std::memory_order_relaxed);
+    mTotal.fetch_add(latency, std::memory_order_relaxed);
+    if (latency > mMax.load(std::memory_order_relaxed))
+        mMax.store(latency, std::memory_order_relaxed);
+    if (mBudget && latency > mBudget)
+        mLate.fetch_add(1, std::memory_order_relaxed);
+}
+
+std::ostream& operator<<(std::ostream& os, const WakeupLatency& latency) {
+    auto count = latency.mCount.load(std::memory_order_relaxed);
+    os << count << " wakeups";
+    if (count) {
+        os << ", avg " << latency.mTotal.load(std::memory_order_relaxed) / count / MICRO << " us"
+           << ", max " << latency.mMax.load(std::memory_order_relaxed) / MICRO << " us"
+           << ", " << latency.mLate.load(std::memory_order_relaxed) << " over budget ("
+           << latency.mBudget / MICRO << " us)";
+    }
+    return os;
+}
+
+}  // namespace drmfb
+}  // namespace V2_1
+}  // namespace composer
+}  // namespace graphics
+}  // namespace hardware
+}  // namespace android
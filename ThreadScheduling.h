@@ -0,0 +1,79 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (C) 2019 Stephan Gerhold
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <iostream>
+#include <sched.h>
+
+#ifndef SCHED_DEADLINE
+#define SCHED_DEADLINE 6
+#endif
+
+namespace android {
+namespace hardware {
+namespace graphics {
+namespace composer {
+namespace V2_1 {
+namespace drmfb {
+
+enum class ThreadClass {
+    EVENT,   // DRM events and vsync timers (drm-event)
+    COMMIT,  // Page flips, mode sets and virtual display copies (drm-commit-*, drm-virtual)
+    HOTPLUG, // Hotplug updates and connector probing (drm-hotplug, drm-probe)
+    BINDER,  // Calls from SurfaceFlinger
+};
+
+/*
+ * Scheduling of a thread class, configured using system properties:
+ *   hwc.drm.sched.<class>: "fifo:<priority>", "rr:<priority>", "nice:<value>"
+ *     or "deadline:<runtime>/<deadline>/<period>" (in µs)
+ *   hwc.drm.sched.<class>.cpus: CPU affinity (e.g. "0-3,6")
+ */
+struct ThreadScheduling {
+    int policy = SCHED_OTHER;
+    int priority = 0; // Real-time priority, or the nice value for SCHED_OTHER
+    uint64_t runtime = 0, deadline = 0, period = 0; // SCHED_DEADLINE, in ns
+    bool affinity = false;
+    cpu_set_t cpus{};
+
+    static ThreadScheduling get(ThreadClass threadClass);
+    bool apply() const; // To the calling thread, children start with SCHED_OTHER
+};
+
+/*
+ * Locks the memory currently mapped by the process (e.g. code, heap and thread
+ * stacks), if enabled (hwc.drm.sched.mlock). Mappings created later (e.g. of
+ * buffers for each frame) are not locked.
+ */
+void lockMemory();
+
+/*
+ * Time between an event (e.g. a vblank or an expired timer) and the thread
+ * handling it. Recorded by the thread itself, so it can be read at any time.
+ */
+struct WakeupLatency {
+    WakeupLatency();
+    void record(int64_t eventTime); // CLOCK_MONOTONIC, in ns
+
+private:
+    const int64_t mBudget; // Wakeups that take longer are counted as late
+
+    std::atomic<uint64_t> mCount{0};
+    std::atomic<int64_t> mTotal{0};
+    std::atomic<int64_t> mMax{0};
+    std::atomic<uint64_t> mLate{0};
+
+    friend std::ostream& operator<<(std::ostream& os, const WakeupLatency& latency);
+};
+
+std::ostream& operator<<(std::ostream& os, const WakeupLatency& latency);
+
+}  // namespace drmfb
+}  // namespace V2_1
+}  // namespace composer
+}  // namespace graphics
+}  // namespace hardware
+}  // namespace android
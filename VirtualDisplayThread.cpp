@@ -0,0 +1,89 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (C) 2019 Stephan Gerhold
+
+#define LOG_TAG "drmfb-virtual"
+
+#include <utility>
+#include <fcntl.h>
+#include <android-base/logging.h>
+#include "DrmFramebuffer.h"
+#include "SoftwareCompositor.h"
+#include "VirtualDisplayThread.h"
+
+namespace android {
+namespace hardware {
+namespace graphics {
+namespace composer {
+namespace V2_1 {
+namespace drmfb {
+
+VirtualDisplayThread::VirtualDisplayThread()
+    : GraphicsThread("drm-virtual", ThreadClass::COMMIT) {}
+
+VirtualDisplayThread::~VirtualDisplayThread() {
+    stop();
+
+    // Copies that were not done anymore must not block the consumer forever
+    std::scoped_lock lock{mQueueMutex};
+    mQueue.clear();
+    mTimeline.signal(mSequence);
+}
+
+bool VirtualDisplayThread::queue(buffer_handle_t src, base::unique_fd srcFence,
+        buffer_handle_t dst, base::unique_fd dstFence, base::unique_fd* presentFence) {
+    Copy copy{};
+    if (!getBufferInfo(src, &copy.src) || !getBufferInfo(dst, &copy.dst))
+        return false;
+
+    copy.srcFd.reset(fcntl(copy.src.fd, F_DUPFD_CLOEXEC, 0));
+    copy.dstFd.reset(fcntl(copy.dst.fd, F_DUPFD_CLOEXEC, 0));
+    if (copy.srcFd < 0 || copy.dstFd < 0) {
+        PLOG(ERROR) << "Failed to duplicate buffers of virtual display";
+        return false;
+    }
+    copy.src.fd = copy.srcFd;
+    copy.dst.fd = copy.dstFd;
+    copy.srcFence = std::move(srcFence);
+    copy.dstFence = std::move(dstFence);
+
+    std::unique_lock lock{mQueueMutex};
+    copy.sequence = ++mSequence;
+    *presentFence = mTimeline.createFence(copy.sequence);
+    if (*presentFence < 0) {
+        // Without a present fence (e.g. no sw_sync), the frame must be complete on return
+        lock.unlock();
+        return SoftwareCompositor::copy(copy.src, std::move(copy.srcFence),
+                                        copy.dst, std::move(copy.dstFence));
+    }
+    mQueue.push_back(std::move(copy));
+
+    // The thread is disabled with the queue lock held once the queue is empty
+    enable();
+    return true;
+}
+
+void VirtualDisplayThread::run() {
+    Copy copy;
+    {
+        std::scoped_lock lock{mQueueMutex};
+        if (mQueue.empty()) {
+            // Nothing to copy, sleep until the next frame is queued
+            disable();
+            return;
+        }
+
+        copy = std::move(mQueue.front());
+        mQueue.pop_front();
+    }
+
+    SoftwareCompositor::copy(copy.src, std::move(copy.srcFence),
+                             copy.dst, std::move(copy.dstFence));
+    mTimeline.signal(copy.sequence);
+}
+
+}  // namespace drmfb
+}  // namespace V2_1
+}  // namespace composer
+}  // namespace graphics
+}  // namespace hardware
+}  // namespace android
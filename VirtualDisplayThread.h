@@ -0,0 +1,58 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (C) 2019 Stephan Gerhold
+
+#pragma once
+
+#include <deque>
+#include <mutex>
+#include <android-base/unique_fd.h>
+#include <cutils/native_handle.h>
+#include "DrmFramebufferImporter.h"
+#include "GraphicsThread.h"
+#include "SyncTimeline.h"
+
+namespace android {
+namespace hardware {
+namespace graphics {
+namespace composer {
+namespace V2_1 {
+namespace drmfb {
+
+/*
+ * Copies the client target into the output buffer of a virtual display,
+ * so presenting the display does not wait for the fences or the copy.
+ * The present fence signals on the timeline once the copy has finished.
+ */
+struct VirtualDisplayThread : public GraphicsThread {
+    VirtualDisplayThread();
+    ~VirtualDisplayThread();
+
+    // The present fence also signals if the copy fails (-1 if it was copied immediately)
+    bool queue(buffer_handle_t src, base::unique_fd srcFence,
+               buffer_handle_t dst, base::unique_fd dstFence,
+               base::unique_fd* presentFence);
+
+protected:
+    void run() override;
+
+private:
+    struct Copy {
+        base::unique_fd srcFd, dstFd; // The buffer handles might be freed before the copy
+        BufferInfo src, dst;
+        base::unique_fd srcFence, dstFence;
+        uint32_t sequence = 0; // Present fence timeline value
+    };
+
+    SyncTimeline mTimeline;
+
+    std::mutex mQueueMutex;
+    std::deque<Copy> mQueue;
+    uint32_t mSequence = 0;
+};
+
+}  // namespace drmfb
+}  // namespace V2_1
+}  // namespace composer
+}  // namespace graphics
+}  // namespace hardware
+}  // namespace android
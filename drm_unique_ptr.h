@@ -16,5 +16,12 @@ using fn_unique_ptr = std::unique_ptr<T, std::integral_constant<decltype(fn), fn
 using unique_res_ptr = fn_unique_ptr<drmModeRes, drmModeFreeResources>;
 using unique_connector_ptr = fn_unique_ptr<drmModeConnector, drmModeFreeConnector>;
 using unique_encoder_ptr = fn_unique_ptr<drmModeEncoder, drmModeFreeEncoder>;
+using unique_crtc_ptr = fn_unique_ptr<drmModeCrtc, drmModeFreeCrtc>;
+using unique_property_ptr = fn_unique_ptr<drmModePropertyRes, drmModeFreeProperty>;
+using unique_blob_ptr = fn_unique_ptr<drmModePropertyBlobRes, drmModeFreePropertyBlob>;
+using unique_plane_res_ptr = fn_unique_ptr<drmModePlaneRes, drmModeFreePlaneResources>;
+using unique_plane_ptr = fn_unique_ptr<drmModePlane, drmModeFreePlane>;
+using unique_object_properties_ptr =
+    fn_unique_ptr<drmModeObjectProperties, drmModeFreeObjectProperties>;
 }
 }
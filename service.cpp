@@ -21,11 +21,16 @@
 #include <binder/ProcessState.h>
 #include <hidl/HidlTransportSupport.h>
 #include "DrmComposer.h"
+#include "ThreadScheduling.h"
 
 using android::hardware::configureRpcThreadpool;
 using android::hardware::joinRpcThreadpool;
+using android::hardware::setMinSchedulerPolicy;
 
 using android::hardware::graphics::composer::V2_1::drmfb::createDrmComposer;
+using android::hardware::graphics::composer::V2_1::drmfb::lockMemory;
+using android::hardware::graphics::composer::V2_1::drmfb::ThreadClass;
+using android::hardware::graphics::composer::V2_1::drmfb::ThreadScheduling;
 
 int main() {
     // the conventional HAL might start binder services
@@ -33,12 +38,9 @@ int main() {
     android::ProcessState::self()->setThreadPoolMaxThreadCount(4);
     android::ProcessState::self()->startThreadPool();
 
-    // same as SF main thread
-    struct sched_param param = {0};
-    param.sched_priority = 2;
-    if (sched_setscheduler(0, SCHED_FIFO | SCHED_RESET_ON_FORK, &param)) {
-        PLOG(ERROR) << "Couldn't set SCHED_FIFO";
-    }
+    // this thread joins the HIDL thread pool (same as SF main thread by default)
+    auto binder = ThreadScheduling::get(ThreadClass::BINDER);
+    binder.apply();
 
     configureRpcThreadpool(4, true /* will join */);
 
@@ -46,10 +48,20 @@ int main() {
     if (!composer) {
         LOG(FATAL) << "Failed to initialize HAL";
     }
+
+    // the other threads of the pool only get the policy while handling calls
+    if (binder.policy != SCHED_DEADLINE
+            && !setMinSchedulerPolicy(composer, binder.policy, binder.priority)) {
+        LOG(ERROR) << "Couldn't set minimum scheduler policy for binder threads";
+    }
+
     if (composer->registerAsService() != android::OK) {
         LOG(FATAL) << "Failed to register Composer HAL";
     }
 
+    // once the threads and libraries are set up, only what is mapped so far is locked
+    lockMemory();
+
     joinRpcThreadpool();
     return 0;
 }